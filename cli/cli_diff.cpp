@@ -26,61 +26,890 @@
  *********************************************************************/
 
 #include <string.h>
+#include <limits.h> // for CHAR_MAX
+#include <getopt.h>
+#ifndef _WIN32
+#include <unistd.h> // for isatty()
+#endif
+
+#include <algorithm>
 #include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
 
 #include "cli.hpp"
-#include "os_string.hpp"
-#include "os_process.hpp"
-#include "trace_resource.hpp"
+#include "cli_pager.hpp"
+
+#include "hash.hpp"
+#include "trace_parser.hpp"
+#include "trace_dump.hpp"
+#include "trace_callset.hpp"
+
+
+enum ColorOption {
+    COLOR_OPTION_NEVER = 0,
+    COLOR_OPTION_ALWAYS = 1,
+    COLOR_OPTION_AUTO = -1
+};
+
+static ColorOption color = COLOR_OPTION_AUTO;
+
+static bool verbose = false;
 
 static const char *synopsis = "Identify differences between two traces.";
 
-static os::String
-find_command(void)
+static void
+usage(void)
+{
+    std::cout
+        << "usage: apitrace diff [OPTIONS] TRACE_FILE TRACE_FILE\n"
+        << synopsis << "\n"
+        "\n"
+        "    -h, --help               show this help message and exit\n"
+        "    -v, --verbose            also compare verbose calls\n"
+        "    -c, --calls=CALLSET      calls to compare [default: all]\n"
+        "        --ref-calls=CALLSET  calls to compare from reference trace\n"
+        "        --src-calls=CALLSET  calls to compare from source trace\n"
+        "    -U, --context=NUM        calls of context around differences [default: 3]\n"
+        "        --color[=WHEN]\n"
+        "        --colour[=WHEN]      colored output\n"
+        "                             WHEN is 'auto', 'always', or 'never'\n"
+        "\n"
+        "Calls are compared as dumped, but regardless of call numbers.\n"
+        "\n"
+    ;
+}
+
+enum {
+    REF_CALLS_OPT = CHAR_MAX + 1,
+    SRC_CALLS_OPT,
+    COLOR_OPT,
+};
+
+const static char *
+shortOptions = "hvc:U:";
+
+const static struct option
+longOptions[] = {
+    {"help", no_argument, 0, 'h'},
+    {"verbose", no_argument, 0, 'v'},
+    {"calls", required_argument, 0, 'c'},
+    {"ref-calls", required_argument, 0, REF_CALLS_OPT},
+    {"src-calls", required_argument, 0, SRC_CALLS_OPT},
+    {"context", required_argument, 0, 'U'},
+    {"colour", optional_argument, 0, COLOR_OPT},
+    {"color", optional_argument, 0, COLOR_OPT},
+    {0, 0, 0, 0}
+};
+
+
+/*
+ * Hashes calls by what is shown when dumping them, that is, their name,
+ * arguments, and return value, but not their call numbers.
+ */
+class CallHasher : public trace::Visitor
+{
+private:
+    uint64_t h;
+
+    enum {
+        TAG_NULL,
+        TAG_BOOL,
+        TAG_SINT,
+        TAG_UINT,
+        TAG_FLOAT,
+        TAG_DOUBLE,
+        TAG_STRING,
+        TAG_STRUCT,
+        TAG_ARRAY,
+        TAG_BLOB,
+        TAG_ELIDED,
+        TAG_POINTER,
+        TAG_ARG,
+        TAG_RET,
+    };
+
+    inline void
+    feed(const void *data, size_t size) {
+        h = hash::hash64(data, size, h);
+    }
+
+    inline void
+    feed(unsigned tag, unsigned long long value) {
+        unsigned long long data[2] = {tag, value};
+        feed(data, sizeof data);
+    }
+
+    inline void
+    feedString(const char *s) {
+        feed(s, strlen(s) + 1);
+    }
+
+public:
+    void visit(trace::Null *) {
+        feed(TAG_NULL, 0);
+    }
+
+    void visit(trace::Bool *node) {
+        feed(TAG_BOOL, node->value);
+    }
+
+    void visit(trace::SInt *node) {
+        feed(TAG_SINT, node->value);
+    }
+
+    void visit(trace::UInt *node) {
+        feed(TAG_UINT, node->value);
+    }
+
+    void visit(trace::Float *node) {
+        feed(TAG_FLOAT, 0);
+        feed(&node->value, sizeof node->value);
+    }
+
+    void visit(trace::Double *node) {
+        feed(TAG_DOUBLE, 0);
+        feed(&node->value, sizeof node->value);
+    }
+
+    void visit(trace::String *node) {
+        feed(TAG_STRING, 0);
+        feedString(node->value);
+    }
+
+    void visit(trace::Enum *node) {
+        feed(TAG_SINT, node->value);
+    }
+
+    void visit(trace::Bitmask *node) {
+        feed(TAG_UINT, node->value);
+    }
+
+    void visit(trace::Struct *node) {
+        feed(TAG_STRUCT, node->members.size());
+        for (unsigned i = 0; i < node->members.size(); ++i) {
+            _visit(node->members[i]);
+        }
+    }
+
+    void visit(trace::Array *node) {
+        feed(TAG_ARRAY, node->values.size());
+        for (unsigned i = 0; i < node->values.size(); ++i) {
+            _visit(node->values[i]);
+        }
+    }
+
+    // Blob contents are not dumped, so neither are they compared
+    void visit(trace::Blob *node) {
+        feed(TAG_BLOB, node->size);
+    }
+
+    void visit(trace::Elided *node) {
+        feed(TAG_ELIDED, node->size);
+    }
+
+    void visit(trace::Pointer *node) {
+        feed(TAG_POINTER, node->value);
+    }
+
+    void visit(trace::Repr *node) {
+        _visit(node->humanValue);
+    }
+
+    uint64_t
+    hashCall(trace::Call *call) {
+        h = 0;
+        feedString(call->name());
+        for (unsigned i = 0; i < call->args.size(); ++i) {
+            feed(TAG_ARG, i);
+            _visit(call->args[i].value);
+        }
+        if (call->ret) {
+            feed(TAG_RET, 0);
+            _visit(call->ret);
+        }
+        return h;
+    }
+};
+
+
+/*
+ * Parses the compared calls of a trace.
+ */
+class CallReader
 {
-    return trace::findScript("tracediff.py");
+private:
+    trace::Parser parser;
+    trace::CallSet calls;
+
+public:
+    bool
+    open(const char *filename, const trace::CallSet &callSet) {
+        calls = callSet;
+        return parser.open(filename);
+    }
+
+    trace::Call *
+    next(void) {
+        trace::Call *call;
+        while ((call = parser.parse_call())) {
+            if (calls.contains(*call) &&
+                (verbose || !(call->flags & trace::CALL_FLAG_VERBOSE))) {
+                return call;
+            }
+            delete call;
+        }
+        return NULL;
+    }
+};
+
+
+/*
+ * Hashes of the compared calls of a trace, and where its frames end.
+ */
+struct TraceHashes {
+    std::vector<uint64_t> calls;
+    std::vector<size_t> frameEnds;
+
+    inline size_t
+    frameStart(size_t frame) const {
+        return frame ? frameEnds[frame - 1] : 0;
+    }
+};
+
+
+static bool
+readHashes(const char *filename, const trace::CallSet &callSet, TraceHashes &hashes)
+{
+    CallReader reader;
+    if (!reader.open(filename, callSet)) {
+        std::cerr << "error: failed to open " << filename << "\n";
+        return false;
+    }
+
+    CallHasher hasher;
+    trace::Call *call;
+    while ((call = reader.next())) {
+        hashes.calls.push_back(hasher.hashCall(call));
+        if (call->flags & trace::CALL_FLAG_END_FRAME) {
+            hashes.frameEnds.push_back(hashes.calls.size());
+        }
+        delete call;
+    }
+
+    if (hashes.frameEnds.empty() ||
+        hashes.frameEnds.back() != hashes.calls.size()) {
+        hashes.frameEnds.push_back(hashes.calls.size());
+    }
+
+    return true;
 }
 
+
+static inline const uint64_t *
+getData(const std::vector<uint64_t> &v)
+{
+    return v.empty() ? NULL : &v[0];
+}
+
+
+/*
+ * Run of equal elements.
+ */
+struct Match {
+    size_t a;
+    size_t b;
+    size_t length;
+};
+
+
+/*
+ * Linear space variant of Myers' O(ND) difference algorithm, as described in
+ * "An O(ND) Difference Algorithm and Its Variations", which finds the runs of
+ * equal elements of two sequences.
+ *
+ * The edit cost explored when bisecting each region is bounded.  Beyond it,
+ * the region is split where the forward path got the furthest, so the diff
+ * may no longer be minimal, but it stays fast.
+ */
+class Differ
+{
+private:
+    enum {
+        MAX_COST = 1024,
+    };
+
+    std::vector<Match> &matches;
+    std::vector<long> v1;
+    std::vector<long> v2;
+
+    void
+    addMatch(size_t a, size_t b, size_t length) {
+        if (!length) {
+            return;
+        }
+        if (!matches.empty()) {
+            Match &last = matches.back();
+            if (last.a + last.length == a &&
+                last.b + last.length == b) {
+                last.length += length;
+                return;
+            }
+        }
+        Match match;
+        match.a = a;
+        match.b = b;
+        match.length = length;
+        matches.push_back(match);
+    }
+
+    // Find the middle snake, where the forward and the reverse paths
+    // overlap, and split the regions there.
+    bool
+    bisect(const uint64_t *a, long n, const uint64_t *b, long m, long &xSplit, long &ySplit) {
+        long maxD = std::min((n + m + 1) / 2, (long)MAX_COST);
+        long vOffset = maxD;
+        long vLength = 2 * maxD + 2;
+        v1.assign(vLength, -1);
+        v2.assign(vLength, -1);
+        v1[vOffset + 1] = 0;
+        v2[vOffset + 1] = 0;
+
+        long delta = n - m;
+        // The front path collides with the reverse path when delta is odd
+        bool front = (delta % 2) != 0;
+
+        long k1start = 0, k1end = 0;
+        long k2start = 0, k2end = 0;
+        long xBest = 0, yBest = 0;
+        for (long d = 0; d < maxD; ++d) {
+            for (long k1 = -d + k1start; k1 <= d - k1end; k1 += 2) {
+                long k1Offset = vOffset + k1;
+                long x1;
+                if (k1 == -d || (k1 != d && v1[k1Offset - 1] < v1[k1Offset + 1])) {
+                    x1 = v1[k1Offset + 1];
+                } else {
+                    x1 = v1[k1Offset - 1] + 1;
+                }
+                long y1 = x1 - k1;
+                while (x1 < n && y1 < m && a[x1] == b[y1]) {
+                    ++x1;
+                    ++y1;
+                }
+                v1[k1Offset] = x1;
+                if (x1 <= n && y1 <= m && x1 + y1 > xBest + yBest) {
+                    xBest = x1;
+                    yBest = y1;
+                }
+                if (x1 > n) {
+                    k1end += 2;
+                } else if (y1 > m) {
+                    k1start += 2;
+                } else if (front) {
+                    long k2Offset = vOffset + delta - k1;
+                    if (k2Offset >= 0 && k2Offset < vLength && v2[k2Offset] != -1) {
+                        if (x1 >= n - v2[k2Offset]) {
+                            xSplit = x1;
+                            ySplit = y1;
+                            return true;
+                        }
+                    }
+                }
+            }
+
+            for (long k2 = -d + k2start; k2 <= d - k2end; k2 += 2) {
+                long k2Offset = vOffset + k2;
+                long x2;
+                if (k2 == -d || (k2 != d && v2[k2Offset - 1] < v2[k2Offset + 1])) {
+                    x2 = v2[k2Offset + 1];
+                } else {
+                    x2 = v2[k2Offset - 1] + 1;
+                }
+                long y2 = x2 - k2;
+                while (x2 < n && y2 < m && a[n - x2 - 1] == b[m - y2 - 1]) {
+                    ++x2;
+                    ++y2;
+                }
+                v2[k2Offset] = x2;
+                if (x2 > n) {
+                    k2end += 2;
+                } else if (y2 > m) {
+                    k2start += 2;
+                } else if (!front) {
+                    long k1Offset = vOffset + delta - k2;
+                    if (k1Offset >= 0 && k1Offset < vLength && v1[k1Offset] != -1) {
+                        long x1 = v1[k1Offset];
+                        long y1 = vOffset + x1 - k1Offset;
+                        if (x1 >= n - x2) {
+                            xSplit = x1;
+                            ySplit = y1;
+                            return true;
+                        }
+                    }
+                }
+            }
+        }
+
+        xSplit = xBest;
+        ySplit = yBest;
+        return true;
+    }
+
+public:
+    Differ(std::vector<Match> &m) :
+        matches(m)
+    {}
+
+    /**
+     * Find the runs of equal elements of a[0..n) and b[0..m), which are
+     * numbered from aBase and bBase respectively, appending them in order.
+     */
+    void
+    diff(const uint64_t *a, size_t n, const uint64_t *b, size_t m,
+         size_t aBase, size_t bBase) {
+        size_t prefix = 0;
+        while (prefix < n && prefix < m && a[prefix] == b[prefix]) {
+            ++prefix;
+        }
+        addMatch(aBase, bBase, prefix);
+        a += prefix;
+        b += prefix;
+        n -= prefix;
+        m -= prefix;
+        aBase += prefix;
+        bBase += prefix;
+
+        size_t suffix = 0;
+        while (suffix < n && suffix < m && a[n - 1 - suffix] == b[m - 1 - suffix]) {
+            ++suffix;
+        }
+        n -= suffix;
+        m -= suffix;
+
+        if (n && m) {
+            long x, y;
+            if (bisect(a, n, b, m, x, y) &&
+                !(x == 0 && y == 0) &&
+                !(x == (long)n && y == (long)m)) {
+                diff(a, x, b, y, aBase, bBase);
+                diff(a + x, n - x, b + y, m - y, aBase + x, bBase + y);
+            }
+        }
+
+        addMatch(aBase + n, bBase + m, suffix);
+    }
+};
+
+
 static void
-usage(void)
+getFrameHashes(const TraceHashes &hashes, std::vector<uint64_t> &frames)
+{
+    for (size_t i = 0; i < hashes.frameEnds.size(); ++i) {
+        size_t start = hashes.frameStart(i);
+        frames.push_back(hash::hash64(getData(hashes.calls) + start,
+                                      (hashes.frameEnds[i] - start) * sizeof(uint64_t)));
+    }
+}
+
+
+/*
+ * Find the frames which can anchor the diff, as done by patience diff: the
+ * longest sequence of frames which appear exactly once in each trace, and in
+ * the same order.
+ */
+static void
+getFrameAnchors(const std::vector<uint64_t> &refFrames,
+                const std::vector<uint64_t> &srcFrames,
+                std::vector<Match> &anchors)
 {
-    os::String command = find_command();
-    if (!command.length()) {
-        exit(1);
+    struct Occurrences {
+        unsigned refCount;
+        unsigned srcCount;
+        size_t refFrame;
+        size_t srcFrame;
+    };
+
+    typedef std::map<uint64_t, Occurrences> OccurrenceMap;
+    OccurrenceMap occurrences;
+    for (size_t i = 0; i < refFrames.size(); ++i) {
+        Occurrences &o = occurrences[refFrames[i]];
+        ++o.refCount;
+        o.refFrame = i;
+    }
+    for (size_t i = 0; i < srcFrames.size(); ++i) {
+        OccurrenceMap::iterator it = occurrences.find(srcFrames[i]);
+        if (it != occurrences.end()) {
+            ++it->second.srcCount;
+            it->second.srcFrame = i;
+        }
     }
 
-    char *args[4];
-    args[0] = (char *) "python";
-    args[1] = (char *) command.str();
-    args[2] = (char *) "--help";
-    args[3] = NULL;
+    // Unique frames, in reference order
+    std::vector<size_t> candidates;
+    std::vector<size_t> candidateRefFrames;
+    for (size_t i = 0; i < refFrames.size(); ++i) {
+        const Occurrences &o = occurrences[refFrames[i]];
+        if (o.refCount == 1 && o.srcCount == 1) {
+            candidates.push_back(o.srcFrame);
+            candidateRefFrames.push_back(i);
+        }
+    }
 
-    os::execute(args);
+    // Longest increasing subsequence of the source frames
+    std::vector<size_t> tails;
+    std::vector<size_t> tailCandidates;
+    std::vector<size_t> predecessors(candidates.size());
+    for (size_t i = 0; i < candidates.size(); ++i) {
+        size_t pile = std::lower_bound(tails.begin(), tails.end(), candidates[i]) - tails.begin();
+        if (pile == tails.size()) {
+            tails.push_back(candidates[i]);
+            tailCandidates.push_back(i);
+        } else {
+            tails[pile] = candidates[i];
+            tailCandidates[pile] = i;
+        }
+        predecessors[i] = pile ? tailCandidates[pile - 1] : ~(size_t)0;
+    }
+
+    anchors.resize(tails.size());
+    size_t i = tails.empty() ? ~(size_t)0 : tailCandidates.back();
+    for (size_t j = tails.size(); j-- > 0; ) {
+        anchors[j].a = candidateRefFrames[i];
+        anchors[j].b = candidates[i];
+        anchors[j].length = 1;
+        i = predecessors[i];
+    }
+}
+
+
+/*
+ * Diff the calls, anchored on frames: the calls between the anchor frames are
+ * compared individually, which bounds the cost of the diff on long traces.
+ */
+static void
+diffTraces(const TraceHashes &ref, const TraceHashes &src, std::vector<Match> &matches)
+{
+    std::vector<uint64_t> refFrames;
+    std::vector<uint64_t> srcFrames;
+    getFrameHashes(ref, refFrames);
+    getFrameHashes(src, srcFrames);
+
+    std::vector<Match> anchors;
+    getFrameAnchors(refFrames, srcFrames, anchors);
+
+    Match end;
+    end.a = refFrames.size();
+    end.b = srcFrames.size();
+    end.length = 0;
+    anchors.push_back(end);
+
+    Differ differ(matches);
+    size_t refFrame = 0;
+    size_t srcFrame = 0;
+    for (size_t i = 0; i < anchors.size(); ++i) {
+        const Match &anchor = anchors[i];
+
+        size_t refStart = ref.frameStart(refFrame);
+        size_t srcStart = src.frameStart(srcFrame);
+        size_t refEnd = ref.frameStart(anchor.a);
+        size_t srcEnd = src.frameStart(anchor.b);
+        differ.diff(getData(ref.calls) + refStart, refEnd - refStart,
+                    getData(src.calls) + srcStart, srcEnd - srcStart,
+                    refStart, srcStart);
+
+        refFrame = anchor.a + anchor.length;
+        srcFrame = anchor.b + anchor.length;
+        size_t length = ref.frameStart(refFrame) - refEnd;
+        assert(length == src.frameStart(srcFrame) - srcEnd);
+        differ.diff(getData(ref.calls) + refEnd, length,
+                    getData(src.calls) + srcEnd, length,
+                    refEnd, srcEnd);
+    }
+}
+
+
+/*
+ * Differing calls, with some context around them.
+ */
+struct Hunk {
+    size_t aBegin;
+    size_t aEnd;
+    size_t bBegin;
+    size_t bEnd;
+};
+
+
+static void
+getHunks(const std::vector<Match> &matches, size_t context, std::vector<Hunk> &hunks)
+{
+    size_t a = 0;
+    size_t b = 0;
+    size_t before = 0;
+    for (size_t i = 0; i < matches.size(); ++i) {
+        const Match &match = matches[i];
+        if (match.a > a || match.b > b) {
+            size_t contextBefore = std::min(context, before);
+            size_t contextAfter = std::min(context, match.length);
+            Hunk hunk;
+            hunk.aBegin = a - contextBefore;
+            hunk.bBegin = b - contextBefore;
+            hunk.aEnd = match.a + contextAfter;
+            hunk.bEnd = match.b + contextAfter;
+            if (!hunks.empty() && hunk.aBegin <= hunks.back().aEnd) {
+                hunks.back().aEnd = hunk.aEnd;
+                hunks.back().bEnd = hunk.bEnd;
+            } else {
+                hunks.push_back(hunk);
+            }
+        }
+        a = match.a + match.length;
+        b = match.b + match.length;
+        before = match.length;
+    }
 }
 
+
+/*
+ * Reads the compared calls of a trace by index, in ascending order.
+ */
+class CallCursor
+{
+private:
+    CallReader reader;
+    trace::Call *call;
+    size_t index;
+
+public:
+    CallCursor() :
+        call(NULL),
+        index(0)
+    {}
+
+    ~CallCursor() {
+        delete call;
+    }
+
+    bool
+    open(const char *filename, const trace::CallSet &callSet) {
+        return reader.open(filename, callSet);
+    }
+
+    trace::Call *
+    get(size_t i) {
+        assert(!call || i >= index);
+        while (!call || index < i) {
+            if (call) {
+                delete call;
+                ++index;
+            }
+            call = reader.next();
+            if (!call) {
+                return NULL;
+            }
+        }
+        return call;
+    }
+};
+
+
+static void
+printCall(std::ostream &os, char prefix, trace::Call *call)
+{
+    const char *start = "";
+    const char *end = "";
+    if (color == COLOR_OPTION_ALWAYS) {
+        if (prefix == '-') {
+            start = "\33[9m\33[31m";
+            end = "\33[0m";
+        } else if (prefix == '+') {
+            start = "\33[32m";
+            end = "\33[0m";
+        }
+    }
+
+    std::ostringstream ss;
+    trace::dump(*call, ss, trace::DUMP_FLAG_NO_COLOR);
+    std::string text = ss.str();
+
+    size_t pos = 0;
+    while (pos < text.length()) {
+        size_t eol = text.find('\n', pos);
+        if (eol == std::string::npos) {
+            eol = text.length();
+        }
+        // Skip the blank lines separating frames
+        if (eol > pos) {
+            os << start << prefix << text.substr(pos, eol - pos) << end << "\n";
+        }
+        pos = eol + 1;
+    }
+}
+
+
+static void
+printHunk(std::ostream &os, const Hunk &hunk, const std::vector<Match> &matches,
+          size_t &matchIndex, CallCursor &ref, CallCursor &src)
+{
+    trace::Call *refCall = hunk.aEnd > hunk.aBegin ? ref.get(hunk.aBegin) : NULL;
+    trace::Call *srcCall = hunk.bEnd > hunk.bBegin ? src.get(hunk.bBegin) : NULL;
+    os << "@@ -";
+    if (refCall) {
+        os << refCall->no << "," << hunk.aEnd - hunk.aBegin;
+    } else {
+        os << "0,0";
+    }
+    os << " +";
+    if (srcCall) {
+        os << srcCall->no << "," << hunk.bEnd - hunk.bBegin;
+    } else {
+        os << "0,0";
+    }
+    os << " @@\n";
+
+    size_t a = hunk.aBegin;
+    size_t b = hunk.bBegin;
+    while (matchIndex + 1 < matches.size() &&
+           matches[matchIndex].a + matches[matchIndex].length <= a) {
+        ++matchIndex;
+    }
+
+    while (a < hunk.aEnd || b < hunk.bEnd) {
+        const Match &match = matches[matchIndex];
+        if (a >= match.a && b >= match.b && a < match.a + match.length) {
+            assert(b == match.b + (a - match.a));
+            printCall(os, ' ', ref.get(a));
+            ++a;
+            ++b;
+            if (a == match.a + match.length) {
+                ++matchIndex;
+            }
+        } else {
+            size_t aStop = std::min(match.a, hunk.aEnd);
+            size_t bStop = std::min(match.b, hunk.bEnd);
+            while (a < aStop) {
+                printCall(os, '-', ref.get(a++));
+            }
+            while (b < bStop) {
+                printCall(os, '+', src.get(b++));
+            }
+            if (a == hunk.aEnd && b == hunk.bEnd) {
+                break;
+            }
+        }
+    }
+}
+
+
 static int
 command(int argc, char *argv[])
 {
-    int i;
+    trace::CallSet calls(trace::FREQUENCY_ALL);
+    const char *refCallsArg = NULL;
+    const char *srcCallsArg = NULL;
+    size_t context = 3;
 
-    os::String command = find_command();
-    if (!command.length()) {
+    int opt;
+    while ((opt = getopt_long(argc, argv, shortOptions, longOptions, NULL)) != -1) {
+        switch (opt) {
+        case 'h':
+            usage();
+            return 0;
+        case 'v':
+            verbose = true;
+            break;
+        case 'c':
+            calls = trace::CallSet(optarg);
+            break;
+        case REF_CALLS_OPT:
+            refCallsArg = optarg;
+            break;
+        case SRC_CALLS_OPT:
+            srcCallsArg = optarg;
+            break;
+        case 'U':
+            context = atoi(optarg);
+            break;
+        case COLOR_OPT:
+            if (!optarg ||
+                !strcmp(optarg, "always")) {
+                color = COLOR_OPTION_ALWAYS;
+            } else if (!strcmp(optarg, "auto")) {
+                color = COLOR_OPTION_AUTO;
+            } else if (!strcmp(optarg, "never")) {
+                color = COLOR_OPTION_NEVER;
+            } else {
+                std::cerr << "error: unknown color argument " << optarg << "\n";
+                return 1;
+            }
+            break;
+        default:
+            std::cerr << "error: unexpected option `" << opt << "`\n";
+            usage();
+            return 1;
+        }
+    }
+
+    if (argc - optind != 2) {
+        std::cerr << "error: incorrect number of arguments\n";
+        usage();
         return 1;
     }
 
-    os::String apitracePath = os::getProcessName();
+    const char *refFilename = argv[optind];
+    const char *srcFilename = argv[optind + 1];
+    trace::CallSet refCalls = refCallsArg ? trace::CallSet(refCallsArg) : calls;
+    trace::CallSet srcCalls = srcCallsArg ? trace::CallSet(srcCallsArg) : calls;
+
+    TraceHashes refHashes;
+    TraceHashes srcHashes;
+    if (!readHashes(refFilename, refCalls, refHashes) ||
+        !readHashes(srcFilename, srcCalls, srcHashes)) {
+        return 1;
+    }
+
+    std::vector<Match> matches;
+    diffTraces(refHashes, srcHashes, matches);
+
+    Match end;
+    end.a = refHashes.calls.size();
+    end.b = srcHashes.calls.size();
+    end.length = 0;
+    matches.push_back(end);
+
+    std::vector<Hunk> hunks;
+    getHunks(matches, context, hunks);
+    if (hunks.empty()) {
+        return 0;
+    }
+
+    if (color == COLOR_OPTION_AUTO) {
+#ifdef _WIN32
+        color = COLOR_OPTION_NEVER;
+#else
+        color = isatty(1) ? COLOR_OPTION_ALWAYS : COLOR_OPTION_NEVER;
+        pipepager();
+#endif
+    }
+
+    // Print the differing calls, reading both traces again
+    CallCursor ref;
+    CallCursor src;
+    if (!ref.open(refFilename, refCalls) ||
+        !src.open(srcFilename, srcCalls)) {
+        std::cerr << "error: failed to reopen traces\n";
+        return 1;
+    }
 
-    std::vector<const char *> args;
-    args.push_back("python");
-    args.push_back(command.str());
-    args.push_back("--apitrace");
-    args.push_back(apitracePath.str());
-    for (i = 1; i < argc; i++) {
-        args.push_back(argv[i]);
+    std::cout << "--- " << refFilename << "\n";
+    std::cout << "+++ " << srcFilename << "\n";
+    size_t matchIndex = 0;
+    for (size_t i = 0; i < hunks.size(); ++i) {
+        printHunk(std::cout, hunks[i], matches, matchIndex, ref, src);
     }
-    args.push_back(NULL);
 
-    return os::execute((char * const *)&args[0]);
+    return 0;
 }
 
 const Command diff_command = {
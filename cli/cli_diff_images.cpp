@@ -25,58 +25,633 @@
  *
  *********************************************************************/
 
+#include <limits.h> // for CHAR_MAX
+#include <math.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <getopt.h>
+
+#include <algorithm>
+#include <fstream>
 #include <iostream>
+#include <set>
+#include <string>
+#include <vector>
 
 #include "cli.hpp"
 #include "os_string.hpp"
-#include "os_process.hpp"
-#include "trace_resource.hpp"
+#include "os_thread.hpp"
+#include "image.hpp"
+
+#ifndef S_ISDIR
+#define S_ISDIR(mode) (((mode) & S_IFMT) == S_IFDIR)
+#endif
+
 
 static const char *synopsis = "Identify differences between two image dumps.";
 
-static os::String
-find_command(void)
+static void
+usage(void)
+{
+    std::cout
+        << "usage: apitrace diff-images [OPTIONS] REF_PREFIX SRC_PREFIX\n"
+        << synopsis << "\n"
+        "\n"
+        "    -h, --help               show this help message and exit\n"
+        "    -v, --verbose            verbose output\n"
+        "    -o, --output=FILE        output filename [default: index.html]\n"
+        "    -f, --fuzz=RATIO         fuzz ratio [default: 0.05]\n"
+        "    -a, --alpha              take alpha channel in consideration\n"
+        "        --overwrite          overwrite images\n"
+        "        --show-all           show all images, including similar ones\n"
+        "    -j, --jobs=N             number of images compared in parallel\n"
+        "                             [default: number of CPUs]\n"
+        "\n"
+    ;
+}
+
+enum {
+    OVERWRITE_OPT = CHAR_MAX + 1,
+    SHOW_ALL_OPT,
+};
+
+const static char *
+shortOptions = "hvo:f:aj:";
+
+const static struct option
+longOptions[] = {
+    {"help", no_argument, 0, 'h'},
+    {"verbose", no_argument, 0, 'v'},
+    {"output", required_argument, 0, 'o'},
+    {"fuzz", required_argument, 0, 'f'},
+    {"alpha", no_argument, 0, 'a'},
+    {"overwrite", no_argument, 0, OVERWRITE_OPT},
+    {"show-all", no_argument, 0, SHOW_ALL_OPT},
+    {"jobs", required_argument, 0, 'j'},
+    {0, 0, 0, 0}
+};
+
+
+static const unsigned thumbSize = 320;
+static const unsigned maxThreads = 256;
+
+static double fuzz = 0.05;
+static bool alpha = false;
+static bool overwrite = false;
+static bool showAll = false;
+
+
+static bool
+isDirectory(const char *path)
+{
+    struct stat st;
+    return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+
+static bool
+getModificationTime(const char *path, time_t &mtime)
+{
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        return false;
+    }
+    mtime = st.st_mtime;
+    return true;
+}
+
+
+static bool
+endsWith(const std::string &s, const char *suffix)
+{
+    size_t len = strlen(suffix);
+    return s.length() >= len && s.compare(s.length() - len, len, suffix) == 0;
+}
+
+
+/*
+ * Snapshots, excluding the difference images and thumbnails we write.
+ */
+static bool
+isImage(const std::string &name)
 {
-    return trace::findScript("snapdiff.py");
+    if (!endsWith(name, ".png") && !endsWith(name, ".qoi")) {
+        return false;
+    }
+    std::string stem(name, 0, name.length() - 4);
+    return !endsWith(stem, ".diff") && !endsWith(stem, ".thumb");
 }
 
+
 static void
-usage(void)
+walkDirectory(const std::string &dir, const std::string &pathPrefix,
+              const std::string &prefix, std::set<std::string> &images)
+{
+    std::vector<os::String> names;
+    if (!os::listDirectory(dir.c_str(), names)) {
+        return;
+    }
+
+    for (size_t i = 0; i < names.size(); ++i) {
+        std::string name(names[i].str());
+        if (name == "." || name == "..") {
+            continue;
+        }
+
+        std::string path = pathPrefix + name;
+        if (isImage(name)) {
+            if (path.compare(0, prefix.length(), prefix) == 0) {
+                images.insert(path.substr(prefix.length()));
+            }
+        } else if (isDirectory(path.c_str())) {
+            walkDirectory(path, path + OS_DIR_SEP, prefix, images);
+        }
+    }
+}
+
+
+/*
+ * Find the images starting with the given prefix, which is either a directory
+ * or a directory followed by a file name prefix.  Returned names are relative
+ * to the prefix.
+ */
+static void
+findImages(const std::string &prefix, std::set<std::string> &images)
+{
+    if (isDirectory(prefix.c_str())) {
+        std::string pathPrefix = prefix;
+        if (!endsWith(pathPrefix, "/") && pathPrefix[pathPrefix.length() - 1] != OS_DIR_SEP) {
+            pathPrefix += OS_DIR_SEP;
+        }
+        walkDirectory(prefix, pathPrefix, prefix, images);
+        return;
+    }
+
+    size_t sep = prefix.find_last_of(std::string("/") + OS_DIR_SEP);
+    if (sep == std::string::npos) {
+        walkDirectory(".", "", prefix, images);
+    } else {
+        walkDirectory(prefix.substr(0, sep + 1), prefix.substr(0, sep + 1), prefix, images);
+    }
+}
+
+
+// Luma, with the same weights and rounding as PIL's RGB to L conversion
+static inline unsigned
+luma(unsigned r, unsigned g, unsigned b)
+{
+    return (r*19595 + g*38470 + b*7471 + 0x8000) >> 16;
+}
+
+
+static inline unsigned
+absDiff(unsigned a, unsigned b)
+{
+    return a > b ? a - b : b - a;
+}
+
+
+static inline unsigned
+getAlpha(const unsigned char *pixel, unsigned channels)
+{
+    return channels >= 4 ? pixel[3] : 255;
+}
+
+
+/*
+ * Count the pixels whose difference exceeds the fuzz, and compute the
+ * precision in bits of the RGB channels.
+ */
+static unsigned long long
+compareImages(const image::Image &ref, const image::Image &src, double &precision)
+{
+    unsigned threshold = (unsigned)(255 * fuzz);
+    unsigned long long ae = 0;
+    unsigned long long squareError = 0;
+
+    const unsigned char *refRow = ref.start();
+    const unsigned char *srcRow = src.start();
+    for (unsigned y = 0; y < src.height; ++y) {
+        const unsigned char *pRef = refRow;
+        const unsigned char *pSrc = srcRow;
+        for (unsigned x = 0; x < src.width; ++x) {
+            unsigned dr = absDiff(pSrc[0], pRef[0]);
+            unsigned dg = absDiff(pSrc[1], pRef[1]);
+            unsigned db = absDiff(pSrc[2], pRef[2]);
+            squareError += dr*dr + dg*dg + db*db;
+
+            if (luma(dr, dg, db) > threshold ||
+                (alpha &&
+                 absDiff(getAlpha(pSrc, src.channels), getAlpha(pRef, ref.channels)) > threshold)) {
+                ++ae;
+            }
+
+            pRef += ref.channels;
+            pSrc += src.channels;
+        }
+        refRow += ref.stride();
+        srcRow += src.stride();
+    }
+
+    double relError = (double)(squareError*2 + 1) /
+                      ((double)src.width*src.height*3*255*255*2);
+    precision = -log(relError)/log(2.0);
+
+    return ae;
+}
+
+
+/*
+ * Make a difference image similar to ImageMagick's compare utility: the
+ * source image, washed out, with differences beyond the fuzz highlighted.
+ */
+static image::Image *
+makeDiffImage(const image::Image &ref, const image::Image &src)
+{
+    static const unsigned lowlight[3] = {0xff, 0xff, 0xff};
+    static const unsigned highlight[3] = {0xf1, 0x00, 0x1e};
+    const unsigned opacity = 0xcc;
+
+    image::Image *diff = new image::Image(src.width, src.height, 3);
+
+    unsigned char *pDiff = diff->pixels;
+    const unsigned char *refRow = ref.start();
+    const unsigned char *srcRow = src.start();
+    for (unsigned y = 0; y < src.height; ++y) {
+        const unsigned char *pRef = refRow;
+        const unsigned char *pSrc = srcRow;
+        for (unsigned x = 0; x < src.width; ++x) {
+            unsigned scaled[3];
+            for (unsigned c = 0; c < 3; ++c) {
+                double value = absDiff(pSrc[c], pRef[c]) / fuzz;
+                scaled[c] = value < 255.0 ? (unsigned)value : 255;
+            }
+            unsigned mask = luma(scaled[0], scaled[1], scaled[2]);
+
+            for (unsigned c = 0; c < 3; ++c) {
+                unsigned marked = (highlight[c]*mask + lowlight[c]*(255 - mask) + 127) / 255;
+                pDiff[c] = (pSrc[c]*(255 - opacity) + marked*opacity + 127) / 255;
+            }
+
+            pRef += ref.channels;
+            pSrc += src.channels;
+            pDiff += 3;
+        }
+        refRow += ref.stride();
+        srcRow += src.stride();
+    }
+
+    return diff;
+}
+
+
+/*
+ * Downscale the image with a box filter, so that it fits in the thumbnail
+ * size.
+ */
+static bool
+writeThumbnail(const image::Image &im, const char *filename)
+{
+    double scale = std::min(std::min((double)thumbSize / im.width,
+                                     (double)thumbSize / im.height), 1.0);
+    unsigned width = std::max((unsigned)(im.width*scale + 0.5), 1U);
+    unsigned height = std::max((unsigned)(im.height*scale + 0.5), 1U);
+
+    image::Image thumb(width, height, 3);
+    unsigned char *dst = thumb.pixels;
+    for (unsigned ty = 0; ty < height; ++ty) {
+        unsigned y0 = ty*im.height/height;
+        unsigned y1 = std::max((ty + 1)*im.height/height, y0 + 1);
+        for (unsigned tx = 0; tx < width; ++tx) {
+            unsigned x0 = tx*im.width/width;
+            unsigned x1 = std::max((tx + 1)*im.width/width, x0 + 1);
+            unsigned long sum[3] = {0, 0, 0};
+            for (unsigned y = y0; y < y1; ++y) {
+                const unsigned char *p = im.start() + (signed)y*im.stride() + x0*im.channels;
+                for (unsigned x = x0; x < x1; ++x) {
+                    sum[0] += p[0];
+                    sum[1] += p[1];
+                    sum[2] += p[2];
+                    p += im.channels;
+                }
+            }
+            unsigned long count = (unsigned long)(y1 - y0)*(x1 - x0);
+            for (unsigned c = 0; c < 3; ++c) {
+                *dst++ = (sum[c] + count/2) / count;
+            }
+        }
+    }
+
+    return thumb.writePNG(filename);
+}
+
+
+// Thumbnails are always PNG, so that browsers can show them
+static std::string
+getThumbnailName(const std::string &filename)
+{
+    return std::string(filename, 0, filename.length() - 4) + ".thumb.png";
+}
+
+
+// Whether the output is missing or older than all the inputs
+static bool
+isOutdated(const std::string &output, const std::string &input1, const std::string &input2)
+{
+    time_t outputTime, inputTime;
+    if (!getModificationTime(output.c_str(), outputTime)) {
+        return true;
+    }
+    if (getModificationTime(input1.c_str(), inputTime) && inputTime <= outputTime) {
+        return false;
+    }
+    if (getModificationTime(input2.c_str(), inputTime) && inputTime <= outputTime) {
+        return false;
+    }
+    return true;
+}
+
+
+/*
+ * Write the thumbnail of an image, unless it is up to date.  The image is
+ * read if not given.
+ */
+static void
+surface(const std::string &filename, const image::Image *im, bool force = false)
+{
+    std::string thumb = getThumbnailName(filename);
+    if (!force && !isOutdated(thumb, filename, filename)) {
+        return;
+    }
+
+    if (im) {
+        writeThumbnail(*im, thumb.c_str());
+    } else {
+        image::Image *read = image::readImage(filename.c_str());
+        if (read) {
+            writeThumbnail(*read, thumb.c_str());
+            delete read;
+        }
+    }
+}
+
+
+struct Comparison {
+    std::string name;
+    std::string refFilename;
+    std::string srcFilename;
+    std::string deltaFilename;
+
+    bool refRead;
+    bool srcRead;
+    bool match;
+    bool surfaced;
+    bool delta;
+    double precision;
+};
+
+
+/*
+ * Compares the image pairs on several threads.  Each pair is compared, and
+ * its difference image and thumbnails written, entirely on one thread.
+ */
+class Comparer
 {
-    os::String command = find_command();
-    if (!command.length()) {
-        exit(1);
+private:
+    std::vector<Comparison> &comparisons;
+
+    os::recursive_mutex mutex;
+    size_t next;
+
+    static void
+    runThread(void *arg) {
+        static_cast<Comparer *>(arg)->run();
+    }
+
+    void
+    run(void) {
+        while (true) {
+            mutex.lock();
+            size_t index = next++;
+            mutex.unlock();
+
+            if (index >= comparisons.size()) {
+                break;
+            }
+
+            compare(comparisons[index]);
+        }
+    }
+
+    void
+    compare(Comparison &comparison) {
+        image::Image *ref = image::readImage(comparison.refFilename.c_str());
+        image::Image *src = image::readImage(comparison.srcFilename.c_str());
+
+        comparison.refRead = ref != NULL;
+        comparison.srcRead = src != NULL;
+        comparison.match = false;
+        comparison.delta = false;
+        comparison.precision = 0.0;
+
+        bool sizeMatch = ref && src &&
+                         ref->width == src->width &&
+                         ref->height == src->height &&
+                         ref->channels >= 3 &&
+                         src->channels >= 3;
+        if (sizeMatch) {
+            comparison.match = compareImages(*ref, *src, comparison.precision) == 0;
+        }
+
+        comparison.surfaced = !comparison.match || showAll;
+        if (comparison.surfaced) {
+            surface(comparison.refFilename, ref);
+            surface(comparison.srcFilename, src);
+            if (sizeMatch) {
+                image::Image *delta = NULL;
+                if (overwrite ||
+                    isOutdated(comparison.deltaFilename, comparison.refFilename, comparison.srcFilename)) {
+                    delta = makeDiffImage(*ref, *src);
+                    delta->writePNG(comparison.deltaFilename.c_str());
+                }
+                surface(comparison.deltaFilename, delta, delta != NULL);
+                delete delta;
+                comparison.delta = true;
+            }
+        }
+
+        delete ref;
+        delete src;
+    }
+
+public:
+    Comparer(std::vector<Comparison> &c) :
+        comparisons(c),
+        next(0)
+    {}
+
+    void
+    run(unsigned numThreads) {
+        next = 0;
+        std::vector<os::thread *> threads;
+        for (unsigned i = 1; i < numThreads; ++i) {
+            threads.push_back(new os::thread(runThread, this));
+        }
+        run();
+        for (size_t i = 0; i < threads.size(); ++i) {
+            threads[i]->join();
+            delete threads[i];
+        }
     }
+};
 
-    char *args[4];
-    args[0] = (char *) "python";
-    args[1] = (char *) command.str();
-    args[2] = (char *) "--help";
-    args[3] = NULL;
 
-    os::execute(args);
+static void
+writeCell(std::ostream &html, const std::string &filename)
+{
+    html << "        <td><a href=\"" << filename << "\"><img src=\"" << getThumbnailName(filename) << "\"/></a></td>\n";
 }
 
+
 static int
 command(int argc, char *argv[])
 {
-    int i;
+    std::string output = "index.html";
+    bool verbose = false;
+    unsigned numThreads = os::thread::hardware_concurrency();
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, shortOptions, longOptions, NULL)) != -1) {
+        switch (opt) {
+        case 'h':
+            usage();
+            return 0;
+        case 'v':
+            verbose = true;
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case 'f':
+            fuzz = atof(optarg);
+            if (fuzz <= 0.0) {
+                std::cerr << "error: fuzz ratio must be positive\n";
+                return 1;
+            }
+            break;
+        case 'a':
+            alpha = true;
+            break;
+        case OVERWRITE_OPT:
+            overwrite = true;
+            break;
+        case SHOW_ALL_OPT:
+            showAll = true;
+            break;
+        case 'j':
+            {
+                char *end;
+                long value = strtol(optarg, &end, 10);
+                if (end == optarg || *end || value < 1 || value > (long)maxThreads) {
+                    std::cerr << "error: number of jobs must be between 1 and " << maxThreads << "\n";
+                    return 1;
+                }
+                numThreads = value;
+            }
+            break;
+        default:
+            std::cerr << "error: unexpected option `" << opt << "`\n";
+            usage();
+            return 1;
+        }
+    }
+
+    if (argc - optind != 2) {
+        std::cerr << "error: incorrect number of arguments\n";
+        usage();
+        return 1;
+    }
 
-    os::String command = find_command();
-    if (!command.length()) {
+    std::string refPrefix = argv[optind];
+    std::string srcPrefix = argv[optind + 1];
+
+    std::set<std::string> refImages;
+    std::set<std::string> srcImages;
+    findImages(refPrefix, refImages);
+    findImages(srcPrefix, srcImages);
+
+    std::vector<Comparison> comparisons;
+    for (std::set<std::string>::const_iterator it = refImages.begin(); it != refImages.end(); ++it) {
+        if (srcImages.find(*it) == srcImages.end()) {
+            continue;
+        }
+        Comparison comparison;
+        comparison.name = *it;
+        comparison.refFilename = refPrefix + *it;
+        comparison.srcFilename = srcPrefix + *it;
+        comparison.deltaFilename = std::string(comparison.srcFilename, 0, comparison.srcFilename.length() - 4) + ".diff.png";
+        comparisons.push_back(comparison);
+    }
+
+    Comparer comparer(comparisons);
+    comparer.run(std::max(numThreads, 1U));
+
+    std::ofstream html(output.c_str());
+    if (!html) {
+        std::cerr << "error: failed to open " << output << "\n";
         return 1;
     }
+    html << "<html>\n";
+    html << "  <body>\n";
+    html << "    <table border=\"1\">\n";
+    html << "      <tr><th>File</th><th>" << refPrefix << "</th><th>" << srcPrefix << "</th><th>&Delta;</th></tr>\n";
 
-    std::vector<const char *> args;
-    args.push_back("python");
-    args.push_back(command.str());
-    for (i = 1; i < argc; i++) {
-        args.push_back(argv[i]);
+    unsigned failures = 0;
+    for (size_t i = 0; i < comparisons.size(); ++i) {
+        const Comparison &comparison = comparisons[i];
+
+        if (!comparison.refRead) {
+            std::cerr << "warning: failed to read " << comparison.refFilename << "\n";
+        }
+        if (!comparison.srcRead) {
+            std::cerr << "warning: failed to read " << comparison.srcFilename << "\n";
+        }
+
+        const char *result;
+        const char *bgcolor;
+        if (comparison.match) {
+            result = "MATCH";
+            bgcolor = "#20ff20";
+        } else {
+            result = "MISMATCH";
+            bgcolor = "#ff2020";
+            ++failures;
+        }
+        if (verbose) {
+            std::cout << "Comparing " << comparison.refFilename << " and " << comparison.srcFilename
+                      << " ... " << result << " (" << comparison.precision << " bits)\n";
+        }
+
+        html << "      <tr>\n";
+        html << "        <td bgcolor=\"" << bgcolor << "\"><a href=\"" << comparison.refFilename << "\">" << comparison.name << "</a></td>\n";
+        if (comparison.surfaced) {
+            writeCell(html, comparison.refFilename);
+            writeCell(html, comparison.srcFilename);
+            if (comparison.delta) {
+                writeCell(html, comparison.deltaFilename);
+            } else {
+                html << "        <td></td>\n";
+            }
+        }
+        html << "      </tr>\n";
     }
-    args.push_back(NULL);
 
-    return os::execute((char * const *)&args[0]);
+    html << "    </table>\n";
+    html << "  </body>\n";
+    html << "</html>\n";
+
+    return failures ? 1 : 0;
 }
 
 const Command diff_images_command = {
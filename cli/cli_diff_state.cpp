@@ -25,15 +25,22 @@
  *
  *********************************************************************/
 
+#include <assert.h>
+#include <ctype.h>
+#include <limits.h> // for CHAR_MAX
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <getopt.h>
 
+#include <algorithm>
 #include <iostream>
+#include <string>
+#include <vector>
 
 #include "cli.hpp"
-#include "os_string.hpp"
-#include "os_process.hpp"
-#include "trace_resource.hpp"
+#include "hash.hpp"
 
 static const char *synopsis = "Identify differences between two state dumps.";
 
@@ -41,30 +48,598 @@ static void
 usage(void)
 {
     std::cout
-        << "usage: apitrace diff-state <state-1> <state-2>\n"
+        << "usage: apitrace diff-state [OPTIONS] <state-1> <state-2>\n"
         << synopsis << "\n"
         "\n"
-        "    Both input files should be the result of running 'glretrace -D XYZ <trace>'.\n";
+        "    Both input files should be the result of running 'glretrace -D XYZ <trace>'.\n"
+        "\n"
+        "    -h, --help           show this help message and exit\n"
+        "        --keep-images    compare images too\n"
+        "\n"
+    ;
 }
 
+enum {
+    KEEP_IMAGES_OPT = CHAR_MAX + 1,
+};
+
 const static char *
 shortOptions = "h";
 
 const static struct option
 longOptions[] = {
     {"help", no_argument, 0, 'h'},
+    {"keep-images", no_argument, 0, KEEP_IMAGES_OPT},
     {0, 0, 0, 0}
 };
 
+
+// Relative tolerance when comparing floating point numbers
+static const double tolerance = 1.0 / (1 << 24);
+
+// Strings longer than this are compared by their hash
+static const size_t maxStringSize = 256;
+
+
+/*
+ * Leaf value of a JSON document, and its path from the root.
+ */
+struct Leaf {
+    std::string path;
+
+    // JSON text, or a summary for long strings
+    std::string value;
+
+    bool isNumber;
+    bool isFloat;
+    double number;
+};
+
+
+/*
+ * Compare paths with array indices, or any other digits, in numeric order.
+ */
+static bool
+comparePaths(const std::string &a, const std::string &b)
+{
+    size_t i = 0;
+    size_t j = 0;
+    while (i < a.length() && j < b.length()) {
+        if (isdigit((unsigned char)a[i]) && isdigit((unsigned char)b[j])) {
+            size_t iEnd = i;
+            size_t jEnd = j;
+            while (iEnd < a.length() && isdigit((unsigned char)a[iEnd])) {
+                ++iEnd;
+            }
+            while (jEnd < b.length() && isdigit((unsigned char)b[jEnd])) {
+                ++jEnd;
+            }
+            if (iEnd - i != jEnd - j) {
+                return iEnd - i < jEnd - j;
+            }
+            int cmp = a.compare(i, iEnd - i, b, j, jEnd - j);
+            if (cmp) {
+                return cmp < 0;
+            }
+            i = iEnd;
+            j = jEnd;
+        } else {
+            if (a[i] != b[j]) {
+                return (unsigned char)a[i] < (unsigned char)b[j];
+            }
+            ++i;
+            ++j;
+        }
+    }
+    return a.length() - i < b.length() - j;
+}
+
+
+static bool
+compareLeaves(const Leaf &a, const Leaf &b)
+{
+    return comparePaths(a.path, b.path);
+}
+
+
+static inline void
+swapLeaves(Leaf &a, Leaf &b)
+{
+    a.path.swap(b.path);
+    a.value.swap(b.value);
+    std::swap(a.isNumber, b.isNumber);
+    std::swap(a.isFloat, b.isFloat);
+    std::swap(a.number, b.number);
+}
+
+
+/*
+ * Range of leaves of an object member.
+ */
+struct Member {
+    std::string name;
+    size_t begin;
+    size_t end;
+};
+
+
+static bool
+compareMembers(const Member &a, const Member &b)
+{
+    return comparePaths(a.name, b.name);
+}
+
+
+/*
+ * Hash of a string, computed over fixed size blocks, so that the result does
+ * not depend on how the string was read.
+ */
+class BlockHasher
+{
+private:
+    enum {
+        BLOCK_SIZE = 4096,
+    };
+
+    char block[BLOCK_SIZE];
+    size_t used;
+    size_t total;
+    uint64_t h;
+
+public:
+    void
+    reset(void) {
+        used = 0;
+        total = 0;
+        h = 0;
+    }
+
+    void
+    update(const char *data, size_t size) {
+        total += size;
+        while (size) {
+            size_t n = std::min(size, (size_t)BLOCK_SIZE - used);
+            memcpy(block + used, data, n);
+            used += n;
+            data += n;
+            size -= n;
+            if (used == BLOCK_SIZE) {
+                h = hash::hash64(block, used, h);
+                used = 0;
+            }
+        }
+    }
+
+    uint64_t
+    digest(void) {
+        return hash::hash64(block, used, h);
+    }
+
+    size_t
+    size(void) const {
+        return total;
+    }
+};
+
+
+/*
+ * Streaming JSON parser, which flattens a document into its leaves.
+ *
+ * Comments are allowed, as in the regression test state dumps.  Unless kept,
+ * images (objects with a __class__ member) are replaced by null, and other
+ * members named __*__ are dropped.
+ */
+class Flattener
+{
+private:
+    FILE *fp;
+    char buffer[65536];
+    size_t pos;
+    size_t len;
+    unsigned long long offset;
+
+    bool keepImages;
+    std::vector<Leaf> &leaves;
+    std::string path;
+
+    BlockHasher hasher;
+
+    inline bool
+    fill(void) {
+        if (pos < len) {
+            return true;
+        }
+        offset += len;
+        pos = 0;
+        len = fread(buffer, 1, sizeof buffer, fp);
+        return len > 0;
+    }
+
+    inline int
+    peek(void) {
+        return fill() ? (unsigned char)buffer[pos] : EOF;
+    }
+
+    inline int
+    get(void) {
+        return fill() ? (unsigned char)buffer[pos++] : EOF;
+    }
+
+    void
+    skipSpace(void) {
+        while (true) {
+            int c = peek();
+            if (c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+                ++pos;
+            } else if (c == '/') {
+                ++pos;
+                if (get() != '/') {
+                    --pos;
+                    return;
+                }
+                while ((c = get()) != EOF && c != '\n')
+                    ;
+            } else {
+                return;
+            }
+        }
+    }
+
+    bool
+    error(const char *message) {
+        std::cerr << "error: " << message << " at offset " << offset + pos << "\n";
+        return false;
+    }
+
+    // Order the leaves of an object by member name, so that the whole
+    // document rarely needs sorting.
+    void
+    sortMembers(std::vector<Member> &members) {
+        size_t i;
+        for (i = 1; i < members.size(); ++i) {
+            if (compareMembers(members[i], members[i - 1])) {
+                break;
+            }
+        }
+        if (i >= members.size()) {
+            return;
+        }
+
+        std::stable_sort(members.begin(), members.end(), compareMembers);
+
+        size_t begin = members.front().begin;
+        size_t end = begin;
+        for (i = 0; i < members.size(); ++i) {
+            begin = std::min(begin, members[i].begin);
+            end = std::max(end, members[i].end);
+        }
+
+        std::vector<Leaf> sorted(end - begin);
+        size_t k = 0;
+        for (i = 0; i < members.size(); ++i) {
+            for (size_t j = members[i].begin; j < members[i].end; ++j) {
+                swapLeaves(sorted[k++], leaves[j]);
+            }
+        }
+        assert(k == sorted.size());
+        for (k = 0; k < sorted.size(); ++k) {
+            swapLeaves(leaves[begin + k], sorted[k]);
+        }
+    }
+
+    void
+    addLeaf(const std::string &value, bool isNumber = false,
+            bool isFloat = false, double number = 0.0) {
+        Leaf leaf;
+        leaf.path = path;
+        leaf.value = value;
+        leaf.isNumber = isNumber;
+        leaf.isFloat = isFloat;
+        leaf.number = number;
+        leaves.push_back(leaf);
+    }
+
+    // Parse a string, including the quotes.  Its text is kept only when
+    // short enough.
+    bool
+    parseString(std::string &text, bool &truncated) {
+        if (get() != '"') {
+            return error("expected string");
+        }
+        text = "\"";
+        truncated = false;
+        hasher.reset();
+        hasher.update("\"", 1);
+        while (true) {
+            if (!fill()) {
+                return error("unterminated string");
+            }
+            const char *start = buffer + pos;
+            const char *end = buffer + len;
+            const char *p = start;
+            while (p < end && *p != '"' && *p != '\\') {
+                ++p;
+            }
+            size_t n = p - start;
+            hasher.update(start, n);
+            if (!truncated) {
+                if (text.length() + n > maxStringSize) {
+                    truncated = true;
+                } else {
+                    text.append(start, n);
+                }
+            }
+            pos += n;
+            if (p == end) {
+                continue;
+            }
+
+            int c = get();
+            char escape[2] = {(char)c, 0};
+            size_t escapeLength = 1;
+            if (c == '\\') {
+                c = get();
+                if (c == EOF) {
+                    return error("unterminated string");
+                }
+                escape[1] = (char)c;
+                escapeLength = 2;
+            }
+            hasher.update(escape, escapeLength);
+            if (!truncated) {
+                text.append(escape, escapeLength);
+            }
+            if (escapeLength == 1) {
+                // Closing quote
+                if (truncated) {
+                    char summary[64];
+                    snprintf(summary, sizeof summary, "<string of %lu bytes, hash %016llx>",
+                             (unsigned long)hasher.size(),
+                             (unsigned long long)hasher.digest());
+                    text = summary;
+                }
+                return true;
+            }
+        }
+    }
+
+    bool
+    parseLiteral(void) {
+        std::string text;
+        int c;
+        while ((c = peek()) != EOF &&
+               (isalnum(c) || c == '-' || c == '+' || c == '.')) {
+            text += (char)c;
+            ++pos;
+        }
+        if (text.empty()) {
+            return error("unexpected character");
+        }
+        if (text == "true" || text == "false" || text == "null") {
+            addLeaf(text);
+            return true;
+        }
+
+        char *end;
+        double number = strtod(text.c_str(), &end);
+        if (*end) {
+            return error("invalid literal");
+        }
+        bool isFloat = text.find_first_of(".eE") != std::string::npos;
+        addLeaf(text, true, isFloat, number);
+        return true;
+    }
+
+    bool
+    parseObject(void) {
+        ++pos;
+        size_t mark = leaves.size();
+        size_t pathLength = path.length();
+        bool empty = true;
+        bool image = false;
+        std::vector<Member> members;
+
+        skipSpace();
+        if (peek() == '}') {
+            ++pos;
+            addLeaf("{}");
+            return true;
+        }
+
+        while (true) {
+            skipSpace();
+            std::string name;
+            bool truncated;
+            if (!parseString(name, truncated)) {
+                return false;
+            }
+            skipSpace();
+            if (get() != ':') {
+                return error("expected `:`");
+            }
+
+            // Strip the quotes
+            name = name.substr(1, name.length() - 2);
+            bool special = name.length() >= 4 &&
+                           name.compare(0, 2, "__") == 0 &&
+                           name.compare(name.length() - 2, 2, "__") == 0;
+            if (!keepImages && name == "__class__") {
+                image = true;
+            }
+
+            size_t memberMark = leaves.size();
+            if (pathLength) {
+                path += '.';
+            }
+            path += name;
+            if (!parseValue()) {
+                return false;
+            }
+            path.resize(pathLength);
+
+            if (!keepImages && special) {
+                leaves.resize(memberMark);
+            } else {
+                empty = false;
+                Member member;
+                member.name = name;
+                member.begin = memberMark;
+                member.end = leaves.size();
+                members.push_back(member);
+            }
+
+            skipSpace();
+            int c = get();
+            if (c == '}') {
+                break;
+            }
+            if (c != ',') {
+                return error("expected `,` or `}`");
+            }
+        }
+
+        if (image) {
+            leaves.resize(mark);
+            addLeaf("null");
+        } else if (empty) {
+            addLeaf("{}");
+        } else {
+            sortMembers(members);
+        }
+        return true;
+    }
+
+    bool
+    parseArray(void) {
+        ++pos;
+        size_t pathLength = path.length();
+
+        skipSpace();
+        if (peek() == ']') {
+            ++pos;
+            addLeaf("[]");
+            return true;
+        }
+
+        for (unsigned index = 0; ; ++index) {
+            char subscript[32];
+            snprintf(subscript, sizeof subscript, "[%u]", index);
+            path += subscript;
+            if (!parseValue()) {
+                return false;
+            }
+            path.resize(pathLength);
+
+            skipSpace();
+            int c = get();
+            if (c == ']') {
+                return true;
+            }
+            if (c != ',') {
+                return error("expected `,` or `]`");
+            }
+        }
+    }
+
+    bool
+    parseValue(void) {
+        skipSpace();
+        switch (peek()) {
+        case '{':
+            return parseObject();
+        case '[':
+            return parseArray();
+        case '"':
+            {
+                std::string text;
+                bool truncated;
+                if (!parseString(text, truncated)) {
+                    return false;
+                }
+                addLeaf(text);
+                return true;
+            }
+        case EOF:
+            return error("unexpected end of file");
+        default:
+            return parseLiteral();
+        }
+    }
+
+public:
+    Flattener(std::vector<Leaf> &l, bool keep) :
+        fp(NULL),
+        pos(0),
+        len(0),
+        offset(0),
+        keepImages(keep),
+        leaves(l)
+    {}
+
+    bool
+    parse(const char *filename) {
+        fp = fopen(filename, "rb");
+        if (!fp) {
+            std::cerr << "error: failed to open " << filename << "\n";
+            return false;
+        }
+
+        bool ok = parseValue();
+        if (ok) {
+            skipSpace();
+            if (peek() != EOF) {
+                ok = error("trailing characters");
+            }
+        }
+
+        fclose(fp);
+        fp = NULL;
+
+        if (!ok) {
+            std::cerr << "error: failed to parse " << filename << "\n";
+            return false;
+        }
+
+        // Member names containing `.` or `[` may still be out of order
+        for (size_t i = 1; i < leaves.size(); ++i) {
+            if (compareLeaves(leaves[i], leaves[i - 1])) {
+                std::stable_sort(leaves.begin(), leaves.end(), compareLeaves);
+                break;
+            }
+        }
+        return true;
+    }
+};
+
+
+static bool
+isEqual(const Leaf &a, const Leaf &b)
+{
+    // Only numbers get the tolerance; NaN and infinities are dumped as null
+    if (a.isNumber && b.isNumber && (a.isFloat || b.isFloat)) {
+        if (a.number == 0.0) {
+            return fabs(b.number) < tolerance;
+        }
+        return fabs((b.number - a.number)/a.number) < tolerance;
+    }
+    return a.value == b.value;
+}
+
+
 static int
 command(int argc, char *argv[])
 {
+    bool keepImages = false;
+
     int opt;
     while ((opt = getopt_long(argc, argv, shortOptions, longOptions, NULL)) != -1) {
         switch (opt) {
         case 'h':
             usage();
             return 0;
+        case KEEP_IMAGES_OPT:
+            keepImages = true;
+            break;
         default:
             std::cerr << "error: unexpected option `" << opt << "`\n";
             usage();
@@ -78,22 +653,38 @@ command(int argc, char *argv[])
         return 1;
     }
 
-    char *file1, *file2;
-
-    file1 = argv[optind];
-    file2 = argv[optind + 1];
-
-    os::String command = trace::findScript("jsondiff.py");
-
-    char *args[5];
+    std::vector<Leaf> a;
+    std::vector<Leaf> b;
+    Flattener flattenerA(a, keepImages);
+    Flattener flattenerB(b, keepImages);
+    if (!flattenerA.parse(argv[optind]) ||
+        !flattenerB.parse(argv[optind + 1])) {
+        return 1;
+    }
 
-    args[0] = const_cast<char *>("python");
-    args[1] = const_cast<char *>(command.str());
-    args[2] = file1;
-    args[3] = file2;
-    args[4] = NULL;
+    // Print the changed paths
+    static const char *missing = "(missing)";
+    size_t i = 0;
+    size_t j = 0;
+    while (i < a.size() || j < b.size()) {
+        if (j == b.size() ||
+            (i < a.size() && comparePaths(a[i].path, b[j].path))) {
+            std::cout << a[i].path << ": " << a[i].value << " -> " << missing << "\n";
+            ++i;
+        } else if (i == a.size() ||
+                   comparePaths(b[j].path, a[i].path)) {
+            std::cout << b[j].path << ": " << missing << " -> " << b[j].value << "\n";
+            ++j;
+        } else {
+            if (!isEqual(a[i], b[j])) {
+                std::cout << a[i].path << ": " << a[i].value << " -> " << b[j].value << "\n";
+            }
+            ++i;
+            ++j;
+        }
+    }
 
-    return os::execute(args);
+    return 0;
 }
 
 const Command diff_state_command = {
@@ -70,6 +70,7 @@ usage(void)
         "    --thread-ids=[=BOOL] dump thread ids [default: no]\n"
         "    --call-nos[=BOOL]    dump call numbers[default: yes]\n"
         "    --arg-names[=BOOL]   dump argument names [default: yes]\n"
+        "    --stats[=BOOL]       dump tracer statistics, if recorded [default: no]\n"
         "\n"
     ;
 }
@@ -80,6 +81,7 @@ enum {
     THREAD_IDS_OPT,
     CALL_NOS_OPT,
     ARG_NAMES_OPT,
+    STATS_OPT,
 };
 
 const static char *
@@ -95,6 +97,7 @@ longOptions[] = {
     {"thread-ids", optional_argument, 0, THREAD_IDS_OPT},
     {"call-nos", optional_argument, 0, CALL_NOS_OPT},
     {"arg-names", optional_argument, 0, ARG_NAMES_OPT},
+    {"stats", optional_argument, 0, STATS_OPT},
     {0, 0, 0, 0}
 };
 
@@ -122,6 +125,7 @@ command(int argc, char *argv[])
 {
     trace::DumpFlags dumpFlags = 0;
     bool dumpThreadIds = false;
+    bool dumpStats = false;
     
     int opt;
     while ((opt = getopt_long(argc, argv, shortOptions, longOptions, NULL)) != -1) {
@@ -158,6 +162,9 @@ command(int argc, char *argv[])
                 dumpFlags |= trace::DUMP_FLAG_NO_CALL_NO;
             }
             break;
+        case STATS_OPT:
+            dumpStats = boolOption(optarg);
+            break;
         case ARG_NAMES_OPT:
             if (boolOption(optarg)) {
                 dumpFlags &= ~trace::DUMP_FLAG_NO_ARG_NAMES;
@@ -206,6 +213,13 @@ command(int argc, char *argv[])
             }
             delete call;
         }
+
+        if (dumpStats) {
+            trace::StatList::const_iterator it;
+            for (it = p.stats.begin(); it != p.stats.end(); ++it) {
+                std::cout << "// " << it->first << " = " << it->second << "\n";
+            }
+        }
     }
 
     return 0;
@@ -148,6 +148,10 @@ public:
         writer.writeByteArray(node->buf, node->size);
     }
 
+    void visit(Elided *node) {
+        writer.writeNone();
+    }
+
     void visit(Pointer *node) {
         writer.writeInt(node->value);
     }
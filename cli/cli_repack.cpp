@@ -24,77 +24,527 @@
  **************************************************************************/
 
 
+#include <limits.h> // for CHAR_MAX
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <getopt.h>
 
+#include <zlib.h>
+
+#include <algorithm>
+#include <deque>
 #include <iostream>
+#include <string>
+#include <vector>
 
 #include "cli.hpp"
 
+#include "os_thread.hpp"
 #include "trace_file.hpp"
+#include "trace_parser.hpp"
 
 
-static const char *synopsis = "Repack a trace file with Snappy compression.";
+static const char *synopsis = "Repack a trace file with Snappy or zlib compression.";
 
 static void
 usage(void)
 {
     std::cout
-        << "usage: apitrace repack <in-trace-file> <out-trace-file>\n"
+        << "usage: apitrace repack [OPTIONS] <in-trace-file> <out-trace-file>\n"
         << synopsis << "\n"
         << "\n"
         << "Snappy compression allows for faster replay and smaller memory footprint,\n"
         << "at the expense of a slightly smaller compression ratio than zlib\n"
+        << "\n"
+        << "    -h, --help               show this help message and exit\n"
+        << "    -z, --codec=CODEC        snappy or zlib [default: snappy]\n"
+        << "    -l, --level=N            zlib compression level [default: 6]\n"
+        << "        --chunk-size=SIZE    uncompressed chunk size, with an optional\n"
+        << "                             k or m suffix [default: 1m]\n"
+        << "        --align-calls        end chunks on call boundaries where possible\n"
+        << "    -j, --jobs=N             number of chunks compressed in parallel\n"
+        << "                             [default: number of CPUs]\n"
         << "\n";
 }
 
+enum {
+    CHUNK_SIZE_OPT = CHAR_MAX + 1,
+    ALIGN_CALLS_OPT,
+};
+
 const static char *
-shortOptions = "h";
+shortOptions = "hz:l:j:";
 
 const static struct option
 longOptions[] = {
     {"help", no_argument, 0, 'h'},
+    {"codec", required_argument, 0, 'z'},
+    {"level", required_argument, 0, 'l'},
+    {"chunk-size", required_argument, 0, CHUNK_SIZE_OPT},
+    {"align-calls", no_argument, 0, ALIGN_CALLS_OPT},
+    {"jobs", required_argument, 0, 'j'},
     {0, 0, 0, 0}
 };
 
+
+enum Codec {
+    CODEC_SNAPPY,
+    CODEC_ZLIB,
+};
+
+static Codec codec = CODEC_SNAPPY;
+static int level = 6;
+static size_t chunkSize = 1024 * 1024;
+static bool alignCalls = false;
+
+static const size_t minChunkSize = 4 * 1024;
+static const size_t maxChunkSize = 1024 * 1024 * 1024;
+static const unsigned maxThreads = 256;
+
+
+/*
+ * Compresses chunks on a pool of threads, and writes them out in order.
+ */
+class ChunkWriter
+{
+private:
+    struct Job {
+        std::string data;
+        std::string encoded;
+        bool done;
+    };
+
+    typedef std::deque<Job *> JobList;
+
+    FILE *stream;
+    bool ok;
+
+    os::recursive_mutex mutex;
+    os::condition_variable cond;
+
+    // Shared state, protected by the mutex
+    JobList pending;
+    JobList jobs;
+    bool stopping;
+
+    // Jobs whose buffers can be reused
+    std::vector<Job *> idle;
+
+    std::vector<os::thread *> threads;
+    size_t maxJobs;
+
+    static void
+    encode(Job *job) {
+        switch (codec) {
+        case CODEC_SNAPPY:
+            trace::File::encodeSnappyChunk(job->data.data(), job->data.size(), job->encoded);
+            break;
+        case CODEC_ZLIB:
+            trace::File::encodeZLibChunk(job->data.data(), job->data.size(), level, job->encoded);
+            break;
+        }
+    }
+
+    static void
+    runThread(void *arg) {
+        static_cast<ChunkWriter *>(arg)->run();
+    }
+
+    void
+    run(void) {
+        mutex.lock();
+        while (true) {
+            while (pending.empty() && !stopping) {
+                cond.wait(mutex);
+            }
+            if (pending.empty()) {
+                break;
+            }
+            Job *job = pending.front();
+            pending.pop_front();
+            mutex.unlock();
+
+            encode(job);
+
+            mutex.lock();
+            job->done = true;
+            cond.notify_all();
+        }
+        mutex.unlock();
+    }
+
+    void
+    writeOut(Job *job) {
+        if (ok &&
+            fwrite(job->encoded.data(), 1, job->encoded.size(), stream) != job->encoded.size()) {
+            ok = false;
+        }
+        idle.push_back(job);
+    }
+
+    // Write the finished jobs, in order.  Must be called with the mutex held,
+    // which is released while writing.
+    void
+    drain(void) {
+        while (!jobs.empty() && jobs.front()->done) {
+            Job *job = jobs.front();
+            jobs.pop_front();
+            mutex.unlock();
+            writeOut(job);
+            mutex.lock();
+        }
+    }
+
+public:
+    ChunkWriter(FILE *_stream, unsigned numThreads) :
+        stream(_stream),
+        ok(true),
+        stopping(false),
+        maxJobs(2 * numThreads)
+    {
+        // With a single job compress on the calling thread
+        if (numThreads > 1) {
+            for (unsigned i = 0; i < numThreads; ++i) {
+                threads.push_back(new os::thread(runThread, this));
+            }
+        }
+    }
+
+    ~ChunkWriter() {
+        finish();
+        for (size_t i = 0; i < idle.size(); ++i) {
+            delete idle[i];
+        }
+    }
+
+    /**
+     * Compress and write a chunk.  The data is swapped with a spare buffer,
+     * which is returned empty.
+     */
+    void
+    write(std::string &data) {
+        Job *job;
+        if (idle.empty()) {
+            job = new Job;
+        } else {
+            job = idle.back();
+            idle.pop_back();
+        }
+        job->data.swap(data);
+        job->done = false;
+        data.clear();
+
+        if (threads.empty()) {
+            encode(job);
+            writeOut(job);
+            return;
+        }
+
+        mutex.lock();
+        drain();
+        while (jobs.size() >= maxJobs) {
+            cond.wait(mutex);
+            drain();
+        }
+        jobs.push_back(job);
+        pending.push_back(job);
+        cond.notify_all();
+        mutex.unlock();
+    }
+
+    /**
+     * Write all chunks, and stop the worker threads.  Returns false if
+     * writing failed.
+     */
+    bool
+    finish(void) {
+        if (!threads.empty()) {
+            mutex.lock();
+            drain();
+            while (!jobs.empty()) {
+                cond.wait(mutex);
+                drain();
+            }
+            stopping = true;
+            cond.notify_all();
+            mutex.unlock();
+
+            for (size_t i = 0; i < threads.size(); ++i) {
+                threads[i]->join();
+                delete threads[i];
+            }
+            threads.clear();
+        }
+        return ok;
+    }
+};
+
+
+/*
+ * Read-only file which keeps a copy of everything read from another, so that
+ * the parser can tell where calls end in the uncompressed stream.
+ */
+class TeeFile : public trace::File {
+public:
+    TeeFile(trace::File *file, std::string &copy) :
+        File(),
+        m_file(file),
+        m_copy(copy)
+    {
+        m_mode = File::Read;
+        m_isOpened = true;
+    }
+
+    ~TeeFile() {
+        close();
+        delete m_file;
+    }
+
+    virtual bool supportsOffsets() const {
+        return m_file->supportsOffsets();
+    }
+
+    virtual File::Offset currentOffset() {
+        return m_file->currentOffset();
+    }
+
+protected:
+    virtual bool rawOpen(const std::string &filename, File::Mode mode) {
+        return false;
+    }
+
+    virtual bool rawWrite(const void *buffer, size_t length) {
+        return false;
+    }
+
+    virtual size_t rawRead(void *buffer, size_t length) {
+        length = m_file->read(buffer, length);
+        m_copy.append((const char *)buffer, length);
+        return length;
+    }
+
+    virtual int rawGetc() {
+        int c = m_file->getc();
+        if (c != -1) {
+            m_copy += (char)c;
+        }
+        return c;
+    }
+
+    virtual void rawClose() {
+        m_file->close();
+    }
+
+    virtual void rawFlush() {}
+
+    virtual bool rawSkip(size_t length) {
+        size_t size = m_copy.size();
+        m_copy.resize(size + length);
+        size_t read = m_file->read(&m_copy[size], length);
+        m_copy.resize(size + read);
+        return read == length;
+    }
+
+    virtual int rawPercentRead() {
+        return m_file->percentRead();
+    }
+
+private:
+    trace::File *m_file;
+    std::string &m_copy;
+};
+
+
+/*
+ * Append the data to the chunk, writing out full chunks.
+ */
+static void
+appendChunk(ChunkWriter &writer, std::string &chunk, const std::string &data)
+{
+    size_t offset = 0;
+    while (chunk.size() + (data.size() - offset) >= chunkSize) {
+        size_t length = chunkSize - chunk.size();
+        chunk.append(data, offset, length);
+        offset += length;
+        writer.write(chunk);
+    }
+    chunk.append(data, offset, std::string::npos);
+}
+
+
+static void
+copyChunks(trace::File *inFile, ChunkWriter &writer)
+{
+    std::string chunk;
+    size_t read;
+    do {
+        chunk.resize(chunkSize);
+        read = inFile->read(&chunk[0], chunkSize);
+        chunk.resize(read);
+        if (read) {
+            writer.write(chunk);
+        }
+    } while (read == chunkSize);
+
+    delete inFile;
+}
+
+
+/*
+ * Copy the trace, ending chunks after the events which complete a call,
+ * unless a single call is larger than the chunk size.
+ */
+static void
+copyCalls(trace::File *inFile, ChunkWriter &writer)
+{
+    std::string events;
+    TeeFile *tee = new TeeFile(inFile, events);
+
+    std::string chunk;
+    chunk.reserve(chunkSize);
+
+    trace::Parser parser;
+    if (parser.open(tee)) {
+        trace::Call *call;
+        while ((call = parser.scan_call())) {
+            delete call;
+            if (!chunk.empty() && chunk.size() + events.size() > chunkSize) {
+                writer.write(chunk);
+            }
+            appendChunk(writer, chunk, events);
+            events.clear();
+        }
+    }
+
+    // Copy whatever the parser did not consume, e.g. incomplete calls
+    char buf[8192];
+    while (tee->read(buf, sizeof buf)) {
+    }
+    appendChunk(writer, chunk, events);
+    if (!chunk.empty()) {
+        writer.write(chunk);
+    }
+
+    parser.close();
+}
+
+
 static int
-repack(const char *inFileName, const char *outFileName)
+repack(const char *inFileName, const char *outFileName, unsigned numThreads)
 {
     trace::File *inFile = trace::File::createForRead(inFileName);
     if (!inFile) {
         return 1;
     }
 
-    trace::File *outFile = trace::File::createForWrite(outFileName);
-    if (!outFile) {
+    FILE *stream = fopen(outFileName, "wb");
+    if (!stream) {
+        std::cerr << "error: could not open " << outFileName << " for writing\n";
         delete inFile;
         return 1;
     }
 
-    size_t size = 8192;
-    char *buf = new char[size];
-    size_t read;
+    if (codec == CODEC_SNAPPY) {
+        std::string header;
+        trace::File::getSnappyHeader(header);
+        fwrite(header.data(), 1, header.size(), stream);
+    }
 
-    while ((read = inFile->read(buf, size)) != 0) {
-        outFile->write(buf, read);
+    ChunkWriter writer(stream, numThreads);
+    if (alignCalls) {
+        copyCalls(inFile, writer);
+    } else {
+        copyChunks(inFile, writer);
     }
 
-    delete [] buf;
-    delete outFile;
-    delete inFile;
+    bool ok = writer.finish();
+    if (fclose(stream) != 0) {
+        ok = false;
+    }
+    if (!ok) {
+        std::cerr << "error: failed to write " << outFileName << "\n";
+        return 1;
+    }
 
     return 0;
 }
 
+static bool
+parseSize(const char *str, size_t &size)
+{
+    char *end;
+    unsigned long long value = strtoull(str, &end, 0);
+    switch (*end) {
+    case 'k':
+    case 'K':
+        value <<= 10;
+        ++end;
+        break;
+    case 'm':
+    case 'M':
+        value <<= 20;
+        ++end;
+        break;
+    }
+    if (end == str || *end) {
+        return false;
+    }
+    size = value;
+    return true;
+}
+
 static int
 command(int argc, char *argv[])
 {
+    unsigned numThreads = os::thread::hardware_concurrency();
+
     int opt;
     while ((opt = getopt_long(argc, argv, shortOptions, longOptions, NULL)) != -1) {
         switch (opt) {
         case 'h':
             usage();
             return 0;
+        case 'z':
+            if (strcmp(optarg, "snappy") == 0) {
+                codec = CODEC_SNAPPY;
+            } else if (strcmp(optarg, "zlib") == 0) {
+                codec = CODEC_ZLIB;
+            } else {
+                std::cerr << "error: unknown codec `" << optarg << "`\n";
+                usage();
+                return 1;
+            }
+            break;
+        case 'l':
+            level = atoi(optarg);
+            if (level < Z_NO_COMPRESSION || level > Z_BEST_COMPRESSION) {
+                std::cerr << "error: invalid compression level `" << optarg << "`\n";
+                return 1;
+            }
+            break;
+        case CHUNK_SIZE_OPT:
+            if (!parseSize(optarg, chunkSize) ||
+                chunkSize < minChunkSize ||
+                chunkSize > maxChunkSize) {
+                std::cerr << "error: invalid chunk size `" << optarg << "`\n";
+                return 1;
+            }
+            break;
+        case ALIGN_CALLS_OPT:
+            alignCalls = true;
+            break;
+        case 'j':
+            {
+                char *end;
+                long value = strtol(optarg, &end, 10);
+                if (end == optarg || *end || value < 1 || value > (long)maxThreads) {
+                    std::cerr << "error: number of jobs must be between 1 and " << maxThreads << "\n";
+                    return 1;
+                }
+                numThreads = value;
+            }
+            break;
         default:
             std::cerr << "error: unexpected option `" << opt << "`\n";
             usage();
@@ -108,7 +558,7 @@ command(int argc, char *argv[])
         return 1;
     }
 
-    return repack(argv[optind], argv[optind + 1]);
+    return repack(argv[optind], argv[optind + 1], std::max(numThreads, 1U));
 }
 
 const Command repack_command = {
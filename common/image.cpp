@@ -27,16 +27,200 @@
 
 #include <assert.h>
 #include <math.h>
+#include <string.h>
 
 #include <algorithm>
 
+#include "hash.hpp"
+#include "os_thread.hpp"
 #include "image.hpp"
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define _IMAGE_SSE2 1
+#include <emmintrin.h>
+#endif
+
 
 namespace image {
 
 
-double Image::compare(Image &ref)
+/*
+ * Images with at least this many pixels are compared on several threads.
+ */
+static const unsigned long long PARALLEL_COMPARE_PIXELS = 1024*1024;
+
+static const unsigned MAX_COMPARE_THREADS = 8;
+
+
+static double
+errorPrecision(unsigned long long error, unsigned long long samples)
+{
+    double numerator = error*2 + 1;
+    double denominator = samples*255ULL*255ULL*2;
+    double quotient = numerator/denominator;
+
+    // Precision in bits
+    return -log(quotient)/log(2.0);
+}
+
+
+/*
+ * Sum of squared differences of two byte arrays.
+ */
+static unsigned long long
+sumSquaredErrors(const unsigned char *a, const unsigned char *b, size_t n)
+{
+    unsigned long long error = 0;
+    size_t i = 0;
+#ifdef _IMAGE_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    while (i + 16 <= n) {
+        // Flush the 32bit accumulators before they can overflow
+        size_t blocks = std::min((n - i)/16, (size_t)8192);
+        size_t blocksEnd = i + blocks*16;
+        __m128i acc = zero;
+        for (; i < blocksEnd; i += 16) {
+            __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+            __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+            __m128i lo = _mm_sub_epi16(_mm_unpacklo_epi8(va, zero),
+                                       _mm_unpacklo_epi8(vb, zero));
+            __m128i hi = _mm_sub_epi16(_mm_unpackhi_epi8(va, zero),
+                                       _mm_unpackhi_epi8(vb, zero));
+            acc = _mm_add_epi32(acc, _mm_madd_epi16(lo, lo));
+            acc = _mm_add_epi32(acc, _mm_madd_epi16(hi, hi));
+        }
+        uint32_t lanes[4];
+        _mm_storeu_si128((__m128i *)lanes, acc);
+        error += (unsigned long long)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    }
+#endif
+    for (; i < n; ++i) {
+        int delta = a[i] - b[i];
+        error += delta*delta;
+    }
+    return error;
+}
+
+
+/*
+ * Sum of squared differences of the RGB channels of a span of pixels, with
+ * the number of channels known at compile time.
+ */
+template <unsigned srcChannels, unsigned refChannels>
+static unsigned long long
+sumSquaredErrorsRGB(const unsigned char *pSrc, const unsigned char *pRef, unsigned width)
+{
+    unsigned long long error = 0;
+    for (unsigned x = 0; x < width; ++x) {
+        int dr = pSrc[0] - pRef[0];
+        int dg = pSrc[1] - pRef[1];
+        int db = pSrc[2] - pRef[2];
+        error += dr*dr + dg*dg + db*db;
+        pSrc += srcChannels;
+        pRef += refChannels;
+    }
+    return error;
+}
+
+
+/*
+ * Sum of squared differences of the first channels of a span of pixels.
+ */
+static unsigned long long
+sumSquaredErrors(const unsigned char *pSrc, unsigned srcChannels,
+                 const unsigned char *pRef, unsigned refChannels,
+                 unsigned minChannels, unsigned width)
+{
+    if (srcChannels == minChannels && refChannels == minChannels) {
+        return sumSquaredErrors(pSrc, pRef, (size_t)width*minChannels);
+    }
+
+    if (minChannels == 3) {
+        if (srcChannels == 4 && refChannels == 3) {
+            return sumSquaredErrorsRGB<4, 3>(pSrc, pRef, width);
+        }
+        if (srcChannels == 3 && refChannels == 4) {
+            return sumSquaredErrorsRGB<3, 4>(pSrc, pRef, width);
+        }
+    }
+
+    unsigned long long error = 0;
+    for (unsigned x = 0; x < width; ++x) {
+        // FIXME: Ignore alpha channel until we are able to pick a visual
+        // that matches the traces
+        for (unsigned c = 0; c < minChannels; ++c) {
+            int delta = pSrc[x*srcChannels + c] - pRef[x*refChannels + c];
+            error += delta*delta;
+        }
+    }
+    return error;
+}
+
+
+/*
+ * Comparison of a band of rows.
+ */
+struct CompareBand {
+    const Image *src;
+    const Image *ref;
+    unsigned minChannels;
+    unsigned y0;
+    unsigned y1;
+    ErrorGrid *grid;
+    unsigned long long error;
+};
+
+
+static void
+compareBand(void *arg)
+{
+    CompareBand *band = static_cast<CompareBand *>(arg);
+    const Image *src = band->src;
+    const Image *ref = band->ref;
+    ErrorGrid *grid = band->grid;
+
+    const unsigned char *pSrc = src->start() + (signed)band->y0*src->stride();
+    const unsigned char *pRef = ref->start() + (signed)band->y0*ref->stride();
+
+    unsigned long long error = 0;
+    for (unsigned y = band->y0; y < band->y1; ++y) {
+        if (grid) {
+            unsigned long long *tileErrors = &grid->errors[(y / grid->tileSize) * grid->columns];
+            for (unsigned column = 0; column < grid->columns; ++column) {
+                unsigned x = column * grid->tileSize;
+                unsigned w = std::min(grid->tileSize, src->width - x);
+                unsigned long long tileError =
+                    sumSquaredErrors(pSrc + x*src->channels, src->channels,
+                                     pRef + x*ref->channels, ref->channels,
+                                     band->minChannels, w);
+                tileErrors[column] += tileError;
+                error += tileError;
+            }
+        } else {
+            error += sumSquaredErrors(pSrc, src->channels,
+                                      pRef, ref->channels,
+                                      band->minChannels, src->width);
+        }
+
+        pSrc += src->stride();
+        pRef += ref->stride();
+    }
+
+    band->error = error;
+}
+
+
+double ErrorGrid::precision(unsigned column, unsigned row) const
+{
+    assert(column < columns && row < rows);
+    unsigned w = std::min(tileSize, width - column*tileSize);
+    unsigned h = std::min(tileSize, height - row*tileSize);
+    return errorPrecision(errors[row*columns + column],
+                          (unsigned long long)w*h*channels);
+}
+
+
+double Image::compare(Image &ref, ErrorGrid *grid)
 {
     if (width != ref.width ||
         height != ref.height ||
@@ -52,32 +236,90 @@ double Image::compare(Image &ref)
         return 0.0;
     }
 
-    const unsigned char *pSrc = start();
-    const unsigned char *pRef = ref.start();
+    if (grid) {
+        assert(grid->tileSize > 0);
+        grid->width = width;
+        grid->height = height;
+        grid->channels = minChannels;
+        grid->columns = (width + grid->tileSize - 1) / grid->tileSize;
+        grid->rows = (height + grid->tileSize - 1) / grid->tileSize;
+        grid->errors.assign((size_t)grid->columns * grid->rows, 0);
+    }
+
+    unsigned numBands = 1;
+    if ((unsigned long long)width*height >= PARALLEL_COMPARE_PIXELS) {
+        numBands = std::min(os::thread::hardware_concurrency(), MAX_COMPARE_THREADS);
+        numBands = std::max(numBands, 1U);
+    }
+
+    // Split the rows in bands, on tile boundaries, so that each tile is only
+    // updated by one thread
+    unsigned bandHeight = (height + numBands - 1) / numBands;
+    if (grid) {
+        bandHeight = (bandHeight + grid->tileSize - 1) / grid->tileSize * grid->tileSize;
+    }
+
+    std::vector<CompareBand> bands;
+    for (unsigned y = 0; y < height; y += bandHeight) {
+        CompareBand band;
+        band.src = this;
+        band.ref = &ref;
+        band.minChannels = minChannels;
+        band.y0 = y;
+        band.y1 = std::min(y + bandHeight, height);
+        band.grid = grid;
+        band.error = 0;
+        bands.push_back(band);
+    }
+
+    std::vector<os::thread *> threads;
+    for (size_t i = 1; i < bands.size(); ++i) {
+        threads.push_back(new os::thread(compareBand, &bands[i]));
+    }
+    if (!bands.empty()) {
+        compareBand(&bands[0]);
+    }
 
     unsigned long long error = 0;
-    for (unsigned y = 0; y < height; ++y) {
-        for (unsigned  x = 0; x < width; ++x) {
-            // FIXME: Ignore alpha channel until we are able to pick a visual
-            // that matches the traces
-            for (unsigned  c = 0; c < minChannels; ++c) {
-                int delta = pSrc[x*channels + c] - pRef[x*ref.channels + c];
-                error += delta*delta;
-            }
+    for (size_t i = 0; i < bands.size(); ++i) {
+        if (i > 0) {
+            threads[i - 1]->join();
+            delete threads[i - 1];
         }
+        error += bands[i].error;
+    }
+
+    return errorPrecision(error, (unsigned long long)height*width*minChannels);
+}
 
-        pSrc += stride();
-        pRef += ref.stride();
+
+/**
+ * Hash of the image dimensions and pixels, from the top row to the bottom
+ * row, regardless of how the rows are laid out in memory.
+ */
+uint64_t Image::hash(void) const
+{
+    unsigned header[3] = {width, height, channels};
+    uint64_t h = hash::hash64(header, sizeof header);
+
+    const unsigned char *row = start();
+    for (unsigned y = 0; y < height; ++y) {
+        h = hash::hash64(row, width*channels, h);
+        row += stride();
     }
 
-    double numerator = error*2 + 1;
-    double denominator = height*width*minChannels*255ULL*255ULL*2;
-    double quotient = numerator/denominator;
+    return h;
+}
 
-    // Precision in bits
-    double precision = -log(quotient)/log(2.0);
 
-    return precision;
+Image *
+readImage(const char *filename)
+{
+    size_t len = strlen(filename);
+    if (len >= 4 && strcmp(filename + len - 4, ".qoi") == 0) {
+        return readQOI(filename);
+    }
+    return readPNG(filename);
 }
 
 
@@ -31,12 +31,50 @@
 #define _IMAGE_HPP_
 
 
+#include <stdint.h>
+
 #include <fstream>
+#include <vector>
 
 
 namespace image {
 
 
+/**
+ * Errors of an image comparison, accumulated over a grid of square tiles, so
+ * that it is possible to tell where the images differ.
+ *
+ * Tiles are numbered from the top left corner of the image, regardless of how
+ * the rows are laid out in memory.  Tiles on the right and bottom edges may
+ * be smaller.
+ */
+class ErrorGrid {
+public:
+    unsigned tileSize;
+
+    unsigned width;
+    unsigned height;
+    unsigned channels;
+    unsigned columns;
+    unsigned rows;
+
+    // Sum of squared errors of each tile, in row-major order
+    std::vector<unsigned long long> errors;
+
+    inline ErrorGrid(unsigned size = 64) :
+        tileSize(size),
+        width(0),
+        height(0),
+        channels(0),
+        columns(0),
+        rows(0)
+    {}
+
+    // Precision in bits of the given tile
+    double precision(unsigned column, unsigned row) const;
+};
+
+
 class Image {
 public:
     unsigned width;
@@ -96,7 +134,16 @@ public:
 
     bool writePNG(const char *filename) const;
 
-    double compare(Image &ref);
+    bool writeQOI(const char *filename) const;
+
+    /**
+     * Average precision in bits of this image relative to the reference
+     * image, or zero if they cannot be compared.  Per-tile errors are also
+     * returned when a grid is given.
+     */
+    double compare(Image &ref, ErrorGrid *grid = NULL);
+
+    uint64_t hash(void) const;
 };
 
 bool writePixelsToBuffer(unsigned char *pixels,
@@ -108,6 +155,15 @@ bool writePixelsToBuffer(unsigned char *pixels,
 Image *
 readPNG(const char *filename);
 
+Image *
+readQOI(const char *filename);
+
+/**
+ * Read a PNG or QOI image, according to the file name extension.
+ */
+Image *
+readImage(const char *filename);
+
 const char *
 readPNMHeader(const char *buffer, size_t size, unsigned *channels, unsigned *width, unsigned *height);
 
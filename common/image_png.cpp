@@ -181,6 +181,14 @@ readPNG(const char *filename)
         png_set_tRNS_to_alpha(png_ptr);
     if (bit_depth == 16)
         png_set_strip_16(png_ptr);
+    if (color_type == PNG_COLOR_TYPE_GRAY ||
+        color_type == PNG_COLOR_TYPE_GRAY_ALPHA)
+        png_set_gray_to_rgb(png_ptr);
+    if (!(color_type & PNG_COLOR_MASK_ALPHA) &&
+        !png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS))
+        png_set_filler(png_ptr, 0xff, PNG_FILLER_AFTER);
+
+    png_read_update_info(png_ptr, info_ptr);
 
     for (unsigned y = 0; y < height; ++y) {
         png_bytep row = (png_bytep)(image->pixels + y*width*4);
@@ -0,0 +1,349 @@
+/**************************************************************************
+ *
+ * Copyright 2026 apitrace contributors
+ * All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ **************************************************************************/
+
+/*
+ * The encoder follows the QOI reference implementation, qoi.h, which is
+ * Copyright (c) 2021, Dominic Szablewski - https://phoboslab.org, and
+ * available under the MIT license.
+ */
+
+
+#include <assert.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "image.hpp"
+
+
+namespace image {
+
+/**
+ * "Quite OK Image" format -- a lossless format which is much faster to
+ * encode and decode than PNG, at a comparable size for rendered images.
+ *
+ * http://qoiformat.org/qoi-specification.pdf
+ */
+
+enum {
+    QOI_OP_INDEX = 0x00,
+    QOI_OP_DIFF  = 0x40,
+    QOI_OP_LUMA  = 0x80,
+    QOI_OP_RUN   = 0xc0,
+    QOI_OP_RGB   = 0xfe,
+    QOI_OP_RGBA  = 0xff,
+
+    QOI_MASK_2   = 0xc0,
+};
+
+static const unsigned QOI_HEADER_SIZE = 14;
+static const unsigned QOI_MAX_RUN = 62;
+
+static const unsigned char qoi_magic[4] = {'q', 'o', 'i', 'f'};
+static const unsigned char qoi_padding[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+
+
+union QOIPixel {
+    struct {
+        unsigned char r, g, b, a;
+    } rgba;
+    uint32_t v;
+};
+
+
+static inline unsigned
+qoiHash(const QOIPixel &px) {
+    return (px.rgba.r*3 + px.rgba.g*5 + px.rgba.b*7 + px.rgba.a*11) % 64;
+}
+
+
+static inline void
+qoiWrite32(unsigned char *p, uint32_t value) {
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
+
+
+static inline uint32_t
+qoiRead32(const unsigned char *p) {
+    return ((uint32_t)p[0] << 24) |
+           ((uint32_t)p[1] << 16) |
+           ((uint32_t)p[2] << 8) |
+           (uint32_t)p[3];
+}
+
+
+bool
+Image::writeQOI(const char *filename) const {
+    assert(channels >= 1 && channels <= 4);
+
+    // Grayscale is expanded, as QOI only does RGB and RGBA
+    unsigned outChannels = channels == 2 || channels == 4 ? 4 : 3;
+
+    size_t maxSize = QOI_HEADER_SIZE +
+                     (size_t)width*height*(outChannels + 1) +
+                     sizeof qoi_padding;
+    unsigned char *buffer = (unsigned char *)malloc(maxSize);
+    if (!buffer) {
+        return false;
+    }
+
+    unsigned char *p = buffer;
+    memcpy(p, qoi_magic, sizeof qoi_magic);
+    qoiWrite32(p + 4, width);
+    qoiWrite32(p + 8, height);
+    p[12] = outChannels;
+    p[13] = 0; // sRGB
+    p += QOI_HEADER_SIZE;
+
+    QOIPixel index[64];
+    memset(index, 0, sizeof index);
+
+    QOIPixel prev;
+    prev.rgba.r = 0;
+    prev.rgba.g = 0;
+    prev.rgba.b = 0;
+    prev.rgba.a = 255;
+
+    QOIPixel px = prev;
+    unsigned run = 0;
+
+    const unsigned char *row = start();
+    for (unsigned y = 0; y < height; ++y) {
+        const unsigned char *src = row;
+        for (unsigned x = 0; x < width; ++x) {
+            switch (channels) {
+            case 4:
+                px.rgba.r = src[0];
+                px.rgba.g = src[1];
+                px.rgba.b = src[2];
+                px.rgba.a = src[3];
+                break;
+            case 3:
+                px.rgba.r = src[0];
+                px.rgba.g = src[1];
+                px.rgba.b = src[2];
+                break;
+            case 2:
+                px.rgba.r = px.rgba.g = px.rgba.b = src[0];
+                px.rgba.a = src[1];
+                break;
+            case 1:
+                px.rgba.r = px.rgba.g = px.rgba.b = src[0];
+                break;
+            }
+            src += channels;
+
+            if (px.v == prev.v) {
+                if (++run == QOI_MAX_RUN) {
+                    *p++ = QOI_OP_RUN | (run - 1);
+                    run = 0;
+                }
+                continue;
+            }
+
+            if (run) {
+                *p++ = QOI_OP_RUN | (run - 1);
+                run = 0;
+            }
+
+            unsigned h = qoiHash(px);
+            if (index[h].v == px.v) {
+                *p++ = QOI_OP_INDEX | h;
+            } else {
+                index[h] = px;
+
+                if (px.rgba.a == prev.rgba.a) {
+                    signed char vr = px.rgba.r - prev.rgba.r;
+                    signed char vg = px.rgba.g - prev.rgba.g;
+                    signed char vb = px.rgba.b - prev.rgba.b;
+                    signed char vg_r = vr - vg;
+                    signed char vg_b = vb - vg;
+
+                    if (vr > -3 && vr < 2 &&
+                        vg > -3 && vg < 2 &&
+                        vb > -3 && vb < 2) {
+                        *p++ = QOI_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2);
+                    } else if (vg_r > -9 && vg_r < 8 &&
+                               vg > -33 && vg < 32 &&
+                               vg_b > -9 && vg_b < 8) {
+                        *p++ = QOI_OP_LUMA | (vg + 32);
+                        *p++ = (vg_r + 8) << 4 | (vg_b + 8);
+                    } else {
+                        *p++ = QOI_OP_RGB;
+                        *p++ = px.rgba.r;
+                        *p++ = px.rgba.g;
+                        *p++ = px.rgba.b;
+                    }
+                } else {
+                    *p++ = QOI_OP_RGBA;
+                    *p++ = px.rgba.r;
+                    *p++ = px.rgba.g;
+                    *p++ = px.rgba.b;
+                    *p++ = px.rgba.a;
+                }
+            }
+
+            prev = px;
+        }
+        row += stride();
+    }
+
+    if (run) {
+        *p++ = QOI_OP_RUN | (run - 1);
+    }
+
+    memcpy(p, qoi_padding, sizeof qoi_padding);
+    p += sizeof qoi_padding;
+
+    bool ok = false;
+    FILE *fp = fopen(filename, "wb");
+    if (fp) {
+        size_t size = p - buffer;
+        ok = fwrite(buffer, 1, size, fp) == size;
+        ok = fclose(fp) == 0 && ok;
+    }
+
+    free(buffer);
+    return ok;
+}
+
+
+Image *
+readQOI(const char *filename)
+{
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) {
+        return NULL;
+    }
+
+    unsigned char header[QOI_HEADER_SIZE];
+    if (fread(header, 1, sizeof header, fp) != sizeof header ||
+        memcmp(header, qoi_magic, sizeof qoi_magic) != 0) {
+        fclose(fp);
+        return NULL;
+    }
+
+    unsigned width = qoiRead32(header + 4);
+    unsigned height = qoiRead32(header + 8);
+    unsigned channels = header[12];
+    if (width == 0 || height == 0 ||
+        (channels != 3 && channels != 4) ||
+        (unsigned long long)width*height > 400000000ULL) {
+        fclose(fp);
+        return NULL;
+    }
+
+    // Read the rest of the file in one go
+    fseek(fp, 0, SEEK_END);
+    long fileSize = ftell(fp);
+    if (fileSize < (long)(QOI_HEADER_SIZE + sizeof qoi_padding)) {
+        fclose(fp);
+        return NULL;
+    }
+    size_t size = fileSize - QOI_HEADER_SIZE;
+    unsigned char *buffer = (unsigned char *)malloc(size);
+    fseek(fp, QOI_HEADER_SIZE, SEEK_SET);
+    if (!buffer || fread(buffer, 1, size, fp) != size) {
+        free(buffer);
+        fclose(fp);
+        return NULL;
+    }
+    fclose(fp);
+
+    Image *image = new Image(width, height, channels);
+
+    QOIPixel index[64];
+    memset(index, 0, sizeof index);
+
+    QOIPixel px;
+    px.rgba.r = 0;
+    px.rgba.g = 0;
+    px.rgba.b = 0;
+    px.rgba.a = 255;
+
+    const unsigned char *p = buffer;
+    const unsigned char *chunksEnd = buffer + size - sizeof qoi_padding;
+    unsigned run = 0;
+
+    unsigned char *dst = image->pixels;
+    unsigned char *dstEnd = dst + (size_t)width*height*channels;
+    while (dst != dstEnd) {
+        if (run) {
+            --run;
+        } else if (p < chunksEnd) {
+            unsigned b1 = *p++;
+            if (b1 == QOI_OP_RGB) {
+                px.rgba.r = p[0];
+                px.rgba.g = p[1];
+                px.rgba.b = p[2];
+                p += 3;
+            } else if (b1 == QOI_OP_RGBA) {
+                px.rgba.r = p[0];
+                px.rgba.g = p[1];
+                px.rgba.b = p[2];
+                px.rgba.a = p[3];
+                p += 4;
+            } else if ((b1 & QOI_MASK_2) == QOI_OP_INDEX) {
+                px = index[b1];
+            } else if ((b1 & QOI_MASK_2) == QOI_OP_DIFF) {
+                px.rgba.r += ((b1 >> 4) & 0x03) - 2;
+                px.rgba.g += ((b1 >> 2) & 0x03) - 2;
+                px.rgba.b += ( b1       & 0x03) - 2;
+            } else if ((b1 & QOI_MASK_2) == QOI_OP_LUMA) {
+                unsigned b2 = *p++;
+                int vg = (b1 & 0x3f) - 32;
+                px.rgba.r += vg - 8 + ((b2 >> 4) & 0x0f);
+                px.rgba.g += vg;
+                px.rgba.b += vg - 8 +  (b2       & 0x0f);
+            } else {
+                run = b1 & 0x3f;
+            }
+            index[qoiHash(px)] = px;
+        } else {
+            // Truncated
+            delete image;
+            free(buffer);
+            return NULL;
+        }
+
+        dst[0] = px.rgba.r;
+        dst[1] = px.rgba.g;
+        dst[2] = px.rgba.b;
+        if (channels == 4) {
+            dst[3] = px.rgba.a;
+        }
+        dst += channels;
+    }
+
+    free(buffer);
+    return image;
+}
+
+
+} /* namespace image */
@@ -30,6 +30,7 @@
 #include <stdlib.h>
 
 #include <unistd.h>
+#include <dirent.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -128,6 +129,23 @@ String::exists(void) const
     return true;
 }
 
+bool
+listDirectory(const String &path, std::vector<String> &names)
+{
+    DIR *dir = opendir(path);
+    if (!dir) {
+        return false;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        names.push_back(entry->d_name);
+    }
+
+    closedir(dir);
+    return true;
+}
+
 int execute(char * const * args)
 {
     pid_t pid = fork();
@@ -397,6 +397,11 @@ bool copyFile(const String &srcFileName, const String &dstFileName, bool overrid
 
 bool removeFile(const String &fileName);
 
+/**
+ * List the names of the entries in a directory.
+ */
+bool listDirectory(const String &path, std::vector<String> &names);
+
 } /* namespace os */
 
 #endif /* _OS_STRING_HPP_ */
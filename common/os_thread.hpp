@@ -37,8 +37,21 @@
 #include <windows.h>
 #else
 #include <pthread.h>
+#include <unistd.h>
 #endif
 
+/*
+ * Compiler-supported thread local storage, which is much faster than
+ * thread_specific_ptr below, but only for POD types, and not available
+ * everywhere.
+ */
+#if defined(_MSC_VER)
+#  define OS_THREAD_SPECIFIC(_type) __declspec(thread) _type
+#elif defined(__GNUC__) && !defined(__APPLE__)
+#  define OS_THREAD_SPECIFIC(_type) __thread _type
+#endif
+
+
 namespace os {
 
 
@@ -80,6 +93,15 @@ namespace os {
 #endif
         }
 
+        inline bool
+        try_lock(void) {
+#ifdef _WIN32
+            return TryEnterCriticalSection(&_native_handle) != 0;
+#else
+            return pthread_mutex_trylock(&_native_handle) == 0;
+#endif
+        }
+
         inline void
         unlock(void) {
 #ifdef _WIN32
@@ -89,11 +111,165 @@ namespace os {
 #endif
         }
 
+        native_handle_type &
+        native_handle(void) {
+            return _native_handle;
+        }
+
     private:
         native_handle_type _native_handle;
     };
 
 
+    /**
+     * Condition variable, to be used with a recursive_mutex locked exactly
+     * once.
+     */
+    class condition_variable
+    {
+    public:
+#ifdef _WIN32
+        typedef CONDITION_VARIABLE native_handle_type;
+#else
+        typedef pthread_cond_t native_handle_type;
+#endif
+
+        condition_variable(void) {
+#ifdef _WIN32
+            InitializeConditionVariable(&_native_handle);
+#else
+            pthread_cond_init(&_native_handle, NULL);
+#endif
+        }
+
+        ~condition_variable() {
+#ifndef _WIN32
+            pthread_cond_destroy(&_native_handle);
+#endif
+        }
+
+        inline void
+        notify_one(void) {
+#ifdef _WIN32
+            WakeConditionVariable(&_native_handle);
+#else
+            pthread_cond_signal(&_native_handle);
+#endif
+        }
+
+        inline void
+        notify_all(void) {
+#ifdef _WIN32
+            WakeAllConditionVariable(&_native_handle);
+#else
+            pthread_cond_broadcast(&_native_handle);
+#endif
+        }
+
+        inline void
+        wait(recursive_mutex &mutex) {
+#ifdef _WIN32
+            SleepConditionVariableCS(&_native_handle, &mutex.native_handle(), INFINITE);
+#else
+            pthread_cond_wait(&_native_handle, &mutex.native_handle());
+#endif
+        }
+
+    private:
+        native_handle_type _native_handle;
+    };
+
+
+    /**
+     * Thread running a plain function.
+     */
+    class thread
+    {
+    public:
+#ifdef _WIN32
+        typedef HANDLE native_handle_type;
+#else
+        typedef pthread_t native_handle_type;
+#endif
+
+        thread(void (*function)(void *), void *arg) {
+            Params *params = new Params;
+            params->function = function;
+            params->arg = arg;
+#ifdef _WIN32
+            _native_handle = CreateThread(NULL, 0, &start, params, 0, &_id);
+#else
+            pthread_create(&_native_handle, NULL, &start, params);
+#endif
+        }
+
+        ~thread() {
+#ifdef _WIN32
+            CloseHandle(_native_handle);
+#endif
+        }
+
+        inline void
+        join(void) {
+#ifdef _WIN32
+            WaitForSingleObject(_native_handle, INFINITE);
+#else
+            pthread_join(_native_handle, NULL);
+#endif
+        }
+
+        /**
+         * Number of hardware threads, or zero if unknown.
+         */
+        static inline unsigned
+        hardware_concurrency(void) {
+#ifdef _WIN32
+            SYSTEM_INFO info;
+            GetSystemInfo(&info);
+            return info.dwNumberOfProcessors;
+#else
+            long count = sysconf(_SC_NPROCESSORS_ONLN);
+            return count > 0 ? count : 0;
+#endif
+        }
+
+        /**
+         * Whether this is the calling thread.
+         */
+        inline bool
+        is_current(void) const {
+#ifdef _WIN32
+            return GetCurrentThreadId() == _id;
+#else
+            return pthread_equal(pthread_self(), _native_handle);
+#endif
+        }
+
+    private:
+        struct Params {
+            void (*function)(void *);
+            void *arg;
+        };
+
+#ifdef _WIN32
+        static DWORD WINAPI
+#else
+        static void *
+#endif
+        start(void *ptr) {
+            Params params = *static_cast<Params *>(ptr);
+            delete static_cast<Params *>(ptr);
+            params.function(params.arg);
+            return 0;
+        }
+
+        native_handle_type _native_handle;
+#ifdef _WIN32
+        DWORD _id;
+#endif
+    };
+
+
     template <typename T>
     class thread_specific_ptr
     {
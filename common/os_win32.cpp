@@ -88,6 +88,26 @@ removeFile(const String &srcFilename)
     return DeleteFileA(srcFilename);
 }
 
+bool
+listDirectory(const String &path, std::vector<String> &names)
+{
+    String pattern(path);
+    pattern.join("*");
+
+    WIN32_FIND_DATAA data;
+    HANDLE hFind = FindFirstFileA(pattern, &data);
+    if (hFind == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+
+    do {
+        names.push_back(data.cFileName);
+    } while (FindNextFileA(hFind, &data));
+
+    FindClose(hFind);
+    return true;
+}
+
 /**
  * Determine whether an argument should be quoted.
  */
@@ -202,6 +202,10 @@ public:
         os << pointer << "blob(" << blob->size << ")" << normal;
     }
 
+    void visit(Elided *elided) {
+        os << pointer << "elided(" << elided->size << ")" << normal;
+    }
+
     void visit(Pointer *p) {
         os << pointer << "0x" << std::hex << p->value << std::dec << normal;
     }
@@ -249,6 +253,8 @@ public:
         
         if (callFlags & CALL_FLAG_INCOMPLETE) {
             os << " // " << red << "incomplete" << normal;
+        } else if (call->enter_time >= 0 && call->leave_time >= 0) {
+            os << " // " << (call->leave_time - call->enter_time) << " ns";
         }
         
         os << "\n";
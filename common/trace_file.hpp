@@ -48,6 +48,25 @@ public:
         uint32_t offsetInChunk;
     };
 
+    /*
+     * Write statistics, for files which compress in chunks.  Times are in
+     * os::getTime() units.
+     */
+    struct Stats {
+        Stats() :
+            chunks(0),
+            compressedBytes(0),
+            compressTime(0),
+            writeTime(0),
+            maxFlushTime(0)
+        {}
+        uint64_t chunks;
+        uint64_t compressedBytes;
+        long long compressTime;
+        long long writeTime;
+        long long maxFlushTime;
+    };
+
 public:
     static bool isZLibCompressed(const std::string &filename);
     static bool isSnappyCompressed(const std::string &filename);
@@ -55,6 +74,16 @@ public:
     static File *createSnappy(void);
     static File *createForRead(const char *filename);
     static File *createForWrite(const char *filename);
+
+    /*
+     * Chunk encoding, for writers which compress chunks on several threads.
+     * A file consists of its header followed by its encoded chunks, in order.
+     */
+    static void getSnappyHeader(std::string &header);
+    static void encodeSnappyChunk(const void *data, size_t length,
+                                  std::string &chunk);
+    static void encodeZLibChunk(const void *data, size_t length, int level,
+                                std::string &chunk);
 public:
     File(const std::string &filename = std::string(),
          File::Mode mode = File::Read);
@@ -72,6 +101,8 @@ public:
     bool skip(size_t length);
     int percentRead();
 
+    const File::Stats &stats() const;
+
     virtual bool supportsOffsets() const = 0;
     virtual File::Offset currentOffset() = 0;
     virtual void setCurrentOffset(const File::Offset &offset);
@@ -88,6 +119,7 @@ protected:
 protected:
     File::Mode m_mode;
     bool m_isOpened;
+    File::Stats m_stats;
 };
 
 inline bool File::isOpened() const
@@ -100,11 +132,17 @@ inline File::Mode File::mode() const
     return m_mode;
 }
 
+inline const File::Stats &File::stats() const
+{
+    return m_stats;
+}
+
 inline bool File::open(const std::string &filename, File::Mode mode)
 {
     if (m_isOpened) {
         close();
     }
+    m_stats = File::Stats();
     m_isOpened = rawOpen(filename, mode);
     m_mode = mode;
 
@@ -38,6 +38,8 @@
  *     compressed data, in little endian
  * }
  * File can contain any number of such chunks.
+ * When the most significant bit of the length is set, the chunk data is
+ * stored raw instead (e.g., because it is already compressed texture data).
  * The default size of an uncompressed chunk is specified in
  * SNAPPY_CHUNK_SIZE.
  *
@@ -46,18 +48,21 @@
  * 1mb, meaning that the compressed data will be <= 1mb.
  * The reason it's 1mb is because it seems
  * to offer a pretty good compression/disk io speed ratio
- * but that might change.
+ * but that might change.  Readers accept chunks of any size, as written
+ * by `apitrace repack --chunk-size`.
  *
  */
 
 
 #include <snappy.h>
 
+#include <algorithm>
 #include <iostream>
 
 #include <assert.h>
 #include <string.h>
 
+#include "os_time.hpp"
 #include "trace_file.hpp"
 
 
@@ -66,6 +71,22 @@
 #define SNAPPY_BYTE1 'a'
 #define SNAPPY_BYTE2 't'
 
+// Chunk length flag for raw (i.e., not compressed) chunks
+#define SNAPPY_RAW_CHUNK 0x80000000U
+
+/*
+ * Chunks are stored raw when compression saves less than
+ * 1/SNAPPY_MIN_GAIN_RATIO of their size.
+ */
+#define SNAPPY_MIN_GAIN_RATIO 16
+
+/*
+ * Before compressing a whole chunk, a few samples of this size are
+ * compressed, to quickly detect high entropy data.
+ */
+#define SNAPPY_PROBE_SIZE (4 * 1024)
+#define SNAPPY_PROBE_COUNT 4
+
 
 using namespace trace;
 
@@ -121,6 +142,7 @@ private:
     char *m_cachePtr;
 
     char *m_compressedCache;
+    size_t m_compressedCacheSize;
 
     File::Offset m_currentOffset;
     std::streampos m_endPos;
@@ -134,9 +156,8 @@ SnappyFile::SnappyFile(const std::string &filename,
       m_cache(new char [m_cacheMaxSize]),
       m_cachePtr(m_cache)
 {
-    size_t maxCompressedLength =
-        snappy::MaxCompressedLength(SNAPPY_CHUNK_SIZE);
-    m_compressedCache = new char[maxCompressedLength];
+    m_compressedCacheSize = snappy::MaxCompressedLength(SNAPPY_CHUNK_SIZE);
+    m_compressedCache = new char[m_compressedCacheSize];
 }
 
 SnappyFile::~SnappyFile()
@@ -265,19 +286,95 @@ void SnappyFile::rawFlush()
     m_stream.flush();
 }
 
+static inline bool
+worthCompressing(size_t inputLength, size_t compressedLength)
+{
+    return compressedLength < inputLength - inputLength / SNAPPY_MIN_GAIN_RATIO;
+}
+
+/*
+ * Quick check whether the data is likely compressible, by compressing a few
+ * samples spread through it.  The scratch buffer must hold the compression of
+ * a sample.
+ */
+static bool
+isCompressible(const char *data, size_t length, char *scratch)
+{
+    if (length < SNAPPY_PROBE_SIZE * SNAPPY_PROBE_COUNT * 2) {
+        return true;
+    }
+
+    size_t stride = (length - SNAPPY_PROBE_SIZE) / (SNAPPY_PROBE_COUNT - 1);
+    size_t inputLength = 0;
+    size_t compressedLength = 0;
+    for (unsigned i = 0; i < SNAPPY_PROBE_COUNT; ++i) {
+        size_t sampleLength;
+        ::snappy::RawCompress(data + i * stride, SNAPPY_PROBE_SIZE,
+                              scratch, &sampleLength);
+        inputLength += SNAPPY_PROBE_SIZE;
+        compressedLength += sampleLength;
+    }
+
+    return worthCompressing(inputLength, compressedLength);
+}
+
+/*
+ * Compress a chunk into a buffer of snappy::MaxCompressedLength(length) bytes,
+ * returning false if it should be stored raw instead.
+ */
+static bool
+compressChunk(const char *data, size_t length,
+              char *compressed, size_t *compressedLength)
+{
+    if (!isCompressible(data, length, compressed)) {
+        return false;
+    }
+    ::snappy::RawCompress(data, length, compressed, compressedLength);
+    return worthCompressing(length, *compressedLength);
+}
+
+static inline void
+encodeLength(size_t length, char *buf)
+{
+    buf[0] = length & 0xff; length >>= 8;
+    buf[1] = length & 0xff; length >>= 8;
+    buf[2] = length & 0xff; length >>= 8;
+    buf[3] = length & 0xff; length >>= 8;
+    assert(length == 0);
+}
+
 void SnappyFile::flushWriteCache()
 {
     size_t inputLength = usedCacheSize();
 
     if (inputLength) {
-        size_t compressedLength;
+        size_t compressedLength = 0;
+        bool compressed = false;
 
-        ::snappy::RawCompress(m_cache, inputLength,
-                              m_compressedCache, &compressedLength);
+        long long startTime = os::getTime();
 
-        writeCompressedLength(compressedLength);
-        m_stream.write(m_compressedCache, compressedLength);
+        compressed = compressChunk(m_cache, inputLength,
+                                   m_compressedCache, &compressedLength);
+
+        long long compressTime = os::getTime();
+
+        if (compressed) {
+            writeCompressedLength(compressedLength);
+            m_stream.write(m_compressedCache, compressedLength);
+        } else {
+            compressedLength = inputLength;
+            writeCompressedLength(inputLength | SNAPPY_RAW_CHUNK);
+            m_stream.write(m_cache, inputLength);
+        }
         m_cachePtr = m_cache;
+
+        long long endTime = os::getTime();
+
+        m_stats.chunks += 1;
+        m_stats.compressedBytes += sizeof(uint32_t) + compressedLength;
+        m_stats.compressTime += compressTime - startTime;
+        m_stats.writeTime += endTime - compressTime;
+        m_stats.maxFlushTime = std::max(m_stats.maxFlushTime, endTime - startTime);
     }
     assert(m_cachePtr == m_cache);
 }
@@ -289,7 +386,21 @@ void SnappyFile::flushReadCache(size_t skipLength)
     size_t compressedLength;
     compressedLength = readCompressedLength();
 
-    if (compressedLength) {
+    if (compressedLength & SNAPPY_RAW_CHUNK) {
+        size_t length = compressedLength & ~SNAPPY_RAW_CHUNK;
+        createCache(length);
+        if (skipLength < length) {
+            m_stream.read(m_cache, length);
+        } else {
+            m_stream.seekg(length, std::ios::cur);
+        }
+    } else if (compressedLength) {
+        // Chunks written with a larger chunk size than ours
+        if (compressedLength > m_compressedCacheSize) {
+            delete [] m_compressedCache;
+            m_compressedCache = new char[compressedLength];
+            m_compressedCacheSize = compressedLength;
+        }
         m_stream.read((char*)m_compressedCache, compressedLength);
         ::snappy::GetUncompressedLength(m_compressedCache, compressedLength,
                                         &m_cacheSize);
@@ -321,13 +432,9 @@ void SnappyFile::createCache(size_t size)
 
 void SnappyFile::writeCompressedLength(size_t length)
 {
-    unsigned char buf[4];
-    buf[0] = length & 0xff; length >>= 8;
-    buf[1] = length & 0xff; length >>= 8;
-    buf[2] = length & 0xff; length >>= 8;
-    buf[3] = length & 0xff; length >>= 8;
-    assert(length == 0);
-    m_stream.write((const char *)buf, sizeof buf);
+    char buf[4];
+    encodeLength(length, buf);
+    m_stream.write(buf, sizeof buf);
 }
 
 size_t SnappyFile::readCompressedLength()
@@ -407,6 +514,33 @@ File* File::createSnappy(void) {
     return new SnappyFile;
 }
 
+void File::getSnappyHeader(std::string &header)
+{
+    header.clear();
+    header += SNAPPY_BYTE1;
+    header += SNAPPY_BYTE2;
+}
+
+void File::encodeSnappyChunk(const void *data, size_t length,
+                             std::string &chunk)
+{
+    assert(length < SNAPPY_RAW_CHUNK);
+
+    chunk.resize(4 + std::max(snappy::MaxCompressedLength(length), length));
+    char *buf = &chunk[0];
+
+    size_t compressedLength = 0;
+    if (length &&
+        compressChunk((const char *)data, length, buf + 4, &compressedLength)) {
+        encodeLength(compressedLength, buf);
+    } else {
+        compressedLength = length;
+        encodeLength(length | SNAPPY_RAW_CHUNK, buf);
+        memcpy(buf + 4, data, length);
+    }
+    chunk.resize(4 + compressedLength);
+}
+
 bool File::isSnappyCompressed(const std::string &filename)
 {
     std::fstream stream(filename.c_str(),
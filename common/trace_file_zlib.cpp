@@ -158,6 +158,31 @@ File * File::createZLib(void) {
     return new ZLibFile;
 }
 
+void File::encodeZLibChunk(const void *data, size_t length, int level,
+                           std::string &chunk)
+{
+    z_stream stream;
+    memset(&stream, 0, sizeof stream);
+
+    // Each chunk is a complete gzip member, and gzread reads through
+    // concatenated members
+    int ret = deflateInit2(&stream, level, Z_DEFLATED, 15 + 16, 8,
+                           Z_DEFAULT_STRATEGY);
+    assert(ret == Z_OK);
+
+    chunk.resize(deflateBound(&stream, length));
+    stream.next_in = (Bytef *)data;
+    stream.avail_in = length;
+    stream.next_out = (Bytef *)&chunk[0];
+    stream.avail_out = chunk.size();
+    ret = deflate(&stream, Z_FINISH);
+    assert(ret == Z_STREAM_END);
+    (void)ret;
+
+    chunk.resize(stream.total_out);
+    deflateEnd(&stream);
+}
+
 bool File::isZLibCompressed(const std::string &filename)
 {
     std::fstream stream(filename.c_str(),
@@ -69,8 +69,22 @@ namespace trace {
  *
  * - version 4:
  *   - call enter events include thread ID
+ *
+ * - version 5:
+ *   - timeline traces: call events may include timestamps, and blob/array
+ *   payloads may be elided, recording only their size
+ *
+ * - version 6:
+ *   - call arguments may be delta encoded against the previous value of the
+ *   same argument of the same function
+ *   - blobs (buffer uploads) may be delta encoded against the previous upload
+ *   to the same object range
+ *   - references are forgotten periodically, on frame boundaries
+ *
+ * - version 7:
+ *   - tracer statistics may be recorded at the end of the trace
  */
-#define TRACE_VERSION 4
+#define TRACE_VERSION 7
 
 
 /*
@@ -80,11 +94,17 @@ namespace trace {
  *
  *   event = EVENT_ENTER thread_id call_sig call_detail+
  *         | EVENT_LEAVE call_no call_detail+
+ *         | EVENT_STATS count (name int)*
  *
  *   call_sig = sig_id ( name arg_names )?
  *
  *   call_detail = ARG index value
+ *               | ARG_KEY index length value
+ *               | ARG_SAME index
+ *               | ARG_DELTA index (mask BYTE*)+
+ *               | ARG_RESET
  *               | RET value
+ *               | TIME int
  *               | END
  *
  *   value = NULL
@@ -102,6 +122,9 @@ namespace trace {
  *         | STRUCT struct_sig value+
  *         | OPAQUE int
  *         | REPR value value
+ *         | ELIDED int
+ *         | BLOB_KEY slot string
+ *         | BLOB_DELTA slot (int int BYTE*)+
  *
  *   call_sig = id name arg_name*
  *            | id
@@ -114,12 +137,29 @@ namespace trace {
  *
  *   string = length (BYTE)*
  *
+ * Delta encoded arguments refer to the bytes of the last ARG_KEY value
+ * recorded for the same function and argument index, as updated by any
+ * subsequent ARG_DELTA.  ARG_DELTA has one mask byte per eight value bytes,
+ * where each set bit is followed by the XOR of the respective byte with its
+ * reference.
+ *
+ * BLOB_KEY blobs are kept in the given slot, and BLOB_DELTA blobs are
+ * relative to and update the slot contents.  Each BLOB_DELTA run consists of
+ * the number of unchanged bytes, the number of changed bytes, and the changed
+ * bytes XORed with the slot contents, until the whole slot is covered.
+ *
+ * ARG_RESET forgets all argument and blob references.
+ *
+ * EVENT_STATS holds named counters about the tracer itself, and is ignored
+ * by the retracers.
+ *
  */
 
 
 enum Event {
     EVENT_ENTER = 0,
     EVENT_LEAVE,
+    EVENT_STATS, // Tracer statistics
 };
 
 enum CallDetail {
@@ -127,6 +167,11 @@ enum CallDetail {
     CALL_ARG,
     CALL_RET,
     CALL_THREAD,
+    CALL_TIME, // Nanoseconds since the trace start
+    CALL_ARG_KEY, // Argument which later deltas refer to
+    CALL_ARG_SAME, // Argument identical to its reference
+    CALL_ARG_DELTA, // Argument differing from its reference in a few bytes
+    CALL_ARG_RESET, // Forget all argument and blob references
 };
 
 enum Type {
@@ -145,6 +190,9 @@ enum Type {
     TYPE_STRUCT,
     TYPE_OPAQUE,
     TYPE_REPR,
+    TYPE_ELIDED, // Blob or array of which only the size was recorded
+    TYPE_BLOB_KEY, // Blob which later deltas refer to
+    TYPE_BLOB_DELTA, // Blob differing from its reference in a few bytes
 };
 
 
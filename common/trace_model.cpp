@@ -84,6 +84,7 @@ bool String ::toBool(void) const { return true; }
 bool Struct ::toBool(void) const { return true; }
 bool Array  ::toBool(void) const { return true; }
 bool Blob   ::toBool(void) const { return true; }
+bool Elided ::toBool(void) const { return true; }
 bool Pointer::toBool(void) const { return value != 0; }
 bool Repr   ::toBool(void) const { return static_cast<bool>(machineValue); }
 
@@ -136,12 +137,14 @@ double Repr   ::toDouble(void) const { return machineValue->toDouble(); }
 void * Value  ::toPointer(void) const { assert(0); return NULL; }
 void * Null   ::toPointer(void) const { return NULL; }
 void * Blob   ::toPointer(void) const { return buf; }
+void * Elided ::toPointer(void) const { return NULL; }
 void * Pointer::toPointer(void) const { return (void *)value; }
 void * Repr   ::toPointer(void) const { return machineValue->toPointer(); }
 
 void * Value  ::toPointer(bool bind) { assert(0); return NULL; }
 void * Null   ::toPointer(bool bind) { return NULL; }
 void * Blob   ::toPointer(bool bind) { if (bind) bound = true; return buf; }
+void * Elided ::toPointer(bool bind) { return NULL; }
 void * Pointer::toPointer(bool bind) { return (void *)value; }
 void * Repr   ::toPointer(bool bind) { return machineValue->toPointer(bind); }
 
@@ -160,6 +163,12 @@ const char * String::toString(void) const { return value; }
 const char * Repr  ::toString(void) const { return machineValue->toString(); }
 
 
+// array cast
+const Array * Value::toArray(void) const { return NULL; }
+const Array * Array::toArray(void) const { return this; }
+const Array * Repr ::toArray(void) const { return machineValue->toArray(); }
+
+
 // virtual Value::visit()
 void Null   ::visit(Visitor &visitor) { visitor.visit(this); }
 void Bool   ::visit(Visitor &visitor) { visitor.visit(this); }
@@ -173,6 +182,7 @@ void Bitmask::visit(Visitor &visitor) { visitor.visit(this); }
 void Struct ::visit(Visitor &visitor) { visitor.visit(this); }
 void Array  ::visit(Visitor &visitor) { visitor.visit(this); }
 void Blob   ::visit(Visitor &visitor) { visitor.visit(this); }
+void Elided ::visit(Visitor &visitor) { visitor.visit(this); }
 void Pointer::visit(Visitor &visitor) { visitor.visit(this); }
 void Repr   ::visit(Visitor &visitor) { visitor.visit(this); }
 
@@ -189,6 +199,7 @@ void Visitor::visit(Bitmask *node) { visit(static_cast<UInt *>(node)); }
 void Visitor::visit(Struct *) { assert(0); }
 void Visitor::visit(Array *) { assert(0); }
 void Visitor::visit(Blob *) { assert(0); }
+void Visitor::visit(Elided *) { assert(0); }
 void Visitor::visit(Pointer *) { assert(0); }
 void Visitor::visit(Repr *node) { node->machineValue->visit(*this); }
 
@@ -196,7 +207,7 @@ void Visitor::visit(Repr *node) { node->machineValue->visit(*this); }
 static Null null;
 
 const Value & Value::operator[](size_t index) const {
-    const Array *array = dynamic_cast<const Array *>(this);
+    const Array *array = toArray();
     if (array) {
         if (index < array->values.size()) {
             return *array->values[index];
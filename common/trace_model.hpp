@@ -35,6 +35,8 @@
 #include <stdlib.h>
 
 #include <map>
+#include <string>
+#include <utility>
 #include <vector>
 
 
@@ -44,6 +46,12 @@ namespace trace {
 typedef unsigned Id;
 
 
+/*
+ * Named counters, such as the tracer statistics.
+ */
+typedef std::vector< std::pair<std::string, unsigned long long> > StatList;
+
+
 struct FunctionSig {
     Id id;
     const char *name;
@@ -87,6 +95,7 @@ struct BitmaskSig {
 
 
 class Visitor;
+class Array;
 
 
 class Value
@@ -105,6 +114,7 @@ public:
     virtual void *toPointer(bool bind);
     virtual unsigned long long toUIntPtr(void) const;
     virtual const char *toString(void) const;
+    virtual const Array *toArray(void) const;
 
     const Value & operator[](size_t index) const;
 };
@@ -274,6 +284,7 @@ public:
     ~Array();
 
     bool toBool(void) const;
+    const Array *toArray(void) const;
     void visit(Visitor &visitor);
 
     std::vector<Value *> values;
@@ -307,6 +318,23 @@ public:
 };
 
 
+/**
+ * Blob or array whose contents were not recorded.
+ */
+class Elided : public Value
+{
+public:
+    Elided(size_t _size) : size(_size) {}
+
+    bool toBool(void) const;
+    void *toPointer(void) const;
+    void *toPointer(bool bind);
+    void visit(Visitor &visitor);
+
+    size_t size;
+};
+
+
 class Pointer : public UInt
 {
 public:
@@ -344,6 +372,7 @@ public:
     virtual void *toPointer(bool bind);
     virtual unsigned long long toUIntPtr(void) const;
     virtual const char *toString(void) const;
+    virtual const Array *toArray(void) const;
 
     void visit(Visitor &visitor);
 };
@@ -364,6 +393,7 @@ public:
     virtual void visit(Struct *);
     virtual void visit(Array *);
     virtual void visit(Blob *);
+    virtual void visit(Elided *);
     virtual void visit(Pointer *);
     virtual void visit(Repr *);
 
@@ -469,12 +499,20 @@ public:
 
     CallFlags flags;
 
+    /**
+     * Enter/leave timestamps in nanoseconds, or negative if not recorded.
+     */
+    long long enter_time;
+    long long leave_time;
+
     Call(FunctionSig *_sig, const CallFlags &_flags, unsigned _thread_id) :
         thread_id(_thread_id), 
         sig(_sig), 
         args(_sig->num_args), 
         ret(0),
-        flags(_flags) {
+        flags(_flags),
+        enter_time(-1),
+        leave_time(-1) {
     }
 
     ~Call();
@@ -29,6 +29,8 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <algorithm>
+
 #include "trace_file.hpp"
 #include "trace_parser.hpp"
 
@@ -39,6 +41,83 @@
 namespace trace {
 
 
+/**
+ * Read-only file over an in-memory buffer, used to parse delta encoded
+ * arguments.
+ *
+ * Offsets are relative to where the buffer was found in the real file, so
+ * that signature definitions inside are detected as such when reparsing.
+ */
+class BufferFile : public File {
+public:
+    BufferFile(const std::string &buffer, const File::Offset &offset) :
+        File(),
+        m_buffer(buffer),
+        m_pos(0),
+        m_offset(offset)
+    {
+        m_mode = File::Read;
+        m_isOpened = true;
+    }
+
+    ~BufferFile() {
+        close();
+    }
+
+    virtual bool supportsOffsets() const {
+        return false;
+    }
+
+    virtual File::Offset currentOffset() {
+        return File::Offset(m_offset.chunk, m_offset.offsetInChunk + m_pos);
+    }
+
+protected:
+    virtual bool rawOpen(const std::string &filename, File::Mode mode) {
+        return false;
+    }
+
+    virtual bool rawWrite(const void *buffer, size_t length) {
+        return false;
+    }
+
+    virtual size_t rawRead(void *buffer, size_t length) {
+        length = std::min(length, m_buffer.size() - m_pos);
+        memcpy(buffer, m_buffer.data() + m_pos, length);
+        m_pos += length;
+        return length;
+    }
+
+    virtual int rawGetc() {
+        if (m_pos >= m_buffer.size()) {
+            return -1;
+        }
+        return (unsigned char)m_buffer[m_pos++];
+    }
+
+    virtual void rawClose() {}
+    virtual void rawFlush() {}
+
+    virtual bool rawSkip(size_t length) {
+        if (length > m_buffer.size() - m_pos) {
+            m_pos = m_buffer.size();
+            return false;
+        }
+        m_pos += length;
+        return true;
+    }
+
+    virtual int rawPercentRead() {
+        return 0;
+    }
+
+private:
+    const std::string &m_buffer;
+    size_t m_pos;
+    File::Offset m_offset;
+};
+
+
 Parser::Parser() {
     file = NULL;
     next_call_no = 0;
@@ -46,6 +125,11 @@ Parser::Parser() {
     api = API_UNKNOWN;
 
     glGetErrorSig = NULL;
+
+    filter = NULL;
+
+    resetPending = false;
+    resetCallNo = 0;
 }
 
 
@@ -56,11 +140,19 @@ Parser::~Parser() {
 
 bool Parser::open(const char *filename) {
     assert(!file);
-    file = File::createForRead(filename);
-    if (!file) {
+    File *inFile = File::createForRead(filename);
+    if (!inFile) {
         return false;
     }
 
+    return open(inFile);
+}
+
+
+bool Parser::open(File *_file) {
+    assert(!file);
+    file = _file;
+
     version = read_uint();
     if (version > TRACE_VERSION) {
         std::cerr << "error: unsupported trace format version " << version << "\n";
@@ -68,6 +160,10 @@ bool Parser::open(const char *filename) {
     }
     api = API_UNKNOWN;
 
+    resetPending = false;
+    resetOffset = file->currentOffset();
+    resetCallNo = 0;
+
     return true;
 }
 
@@ -151,6 +247,10 @@ void Parser::close(void) {
     }
     bitmasks.clear();
 
+    argValues.clear();
+    blobValues.clear();
+    stats.clear();
+
     next_call_no = 0;
 }
 
@@ -158,15 +258,63 @@ void Parser::close(void) {
 void Parser::getBookmark(ParseBookmark &bookmark) {
     bookmark.offset = file->currentOffset();
     bookmark.next_call_no = next_call_no;
+
+    if (argValues.empty() && blobValues.empty()) {
+        bookmark.reset_offset = bookmark.offset;
+        bookmark.reset_call_no = bookmark.next_call_no;
+    } else {
+        bookmark.reset_offset = resetOffset;
+        bookmark.reset_call_no = resetCallNo;
+    }
 }
 
 
 void Parser::setBookmark(const ParseBookmark &bookmark) {
-    file->setCurrentOffset(bookmark.offset);
-    next_call_no = bookmark.next_call_no;
+    file->setCurrentOffset(bookmark.reset_offset);
+    next_call_no = bookmark.reset_call_no;
     
     // Simply ignore all pending calls
     deleteAll(calls);
+
+    resetReferences();
+
+    // Rebuild the delta encoding references, by scanning the events from the
+    // last reset up to the bookmark
+    while (file->currentOffset() < bookmark.offset) {
+        int c = read_byte();
+        if (c == trace::EVENT_ENTER) {
+            parse_enter(SCAN);
+        } else if (c == trace::EVENT_LEAVE) {
+            delete parse_leave(SCAN);
+        } else if (c == trace::EVENT_STATS) {
+            parse_stats();
+        } else {
+            break;
+        }
+    }
+
+    assert(file->currentOffset() == bookmark.offset);
+    assert(next_call_no == bookmark.next_call_no);
+    deleteAll(calls);
+}
+
+
+void Parser::setCallFilter(const CallFilter *_filter) {
+    filter = _filter;
+
+    for (FunctionMap::iterator it = functions.begin(); it != functions.end(); ++it) {
+        FunctionSigState *sig = *it;
+        if (sig) {
+            sig->skip = filter && filter->skip(sig);
+        }
+    }
+}
+
+
+void Parser::resetReferences(void) {
+    argValues.clear();
+    blobValues.clear();
+    resetPending = false;
 }
 
 
@@ -182,6 +330,9 @@ Call *Parser::parse_call(Mode mode) {
             call = parse_leave(mode);
             adjust_call_flags(call);
             return call;
+        case trace::EVENT_STATS:
+            parse_stats();
+            break;
         default:
             std::cerr << "error: unknown event " << c << "\n";
             exit(1);
@@ -231,6 +382,7 @@ Parser::parse_function_sig(void) {
         }
         sig->arg_names = arg_names;
         sig->flags = lookupCallFlags(sig->name);
+        sig->skip = filter && filter->skip(sig);
         sig->offset = file->currentOffset();
         functions[id] = sig;
 
@@ -414,6 +566,17 @@ BitmaskSig *Parser::parse_bitmask_sig() {
 }
 
 
+void Parser::parse_stats(void) {
+    size_t count = read_uint();
+    for (size_t i = 0; i < count; ++i) {
+        const char *name = read_string();
+        unsigned long long value = read_uint();
+        stats.push_back(std::make_pair(std::string(name), value));
+        delete [] name;
+    }
+}
+
+
 void Parser::parse_enter(Mode mode) {
     unsigned thread_id;
 
@@ -425,6 +588,10 @@ void Parser::parse_enter(Mode mode) {
 
     FunctionSigFlags *sig = parse_function_sig();
 
+    if (mode == FULL && sig->skip) {
+        mode = SKIP;
+    }
+
     Call *call = new Call(sig, sig->flags, thread_id);
 
     call->no = next_call_no++;
@@ -451,6 +618,10 @@ Call *Parser::parse_leave(Mode mode) {
         return NULL;
     }
 
+    if (mode == FULL && functions[call->sig->id]->skip) {
+        mode = SKIP;
+    }
+
     if (parse_call_details(call, mode)) {
         return call;
     } else {
@@ -465,13 +636,28 @@ bool Parser::parse_call_details(Call *call, Mode mode) {
         int c = read_byte();
         switch (c) {
         case trace::CALL_END:
+            if (resetPending) {
+                resetPending = false;
+                resetOffset = file->currentOffset();
+                resetCallNo = next_call_no;
+            }
             return true;
         case trace::CALL_ARG:
-            parse_arg(call, mode);
+        case trace::CALL_ARG_KEY:
+        case trace::CALL_ARG_SAME:
+        case trace::CALL_ARG_DELTA:
+            parse_arg(call, mode, c);
+            break;
+        case trace::CALL_ARG_RESET:
+            resetReferences();
+            resetPending = true;
             break;
         case trace::CALL_RET:
             call->ret = parse_value(mode);
             break;
+        case trace::CALL_TIME:
+            parse_time(call);
+            break;
         default:
             std::cerr << "error: ("<<call->name()<< ") unknown call detail "
                       << c << "\n";
@@ -498,9 +684,26 @@ void Parser::adjust_call_flags(Call *call) {
     }
 }
 
-void Parser::parse_arg(Call *call, Mode mode) {
+/**
+ * The first timestamp of a call is recorded on enter, the second on leave.
+ */
+void Parser::parse_time(Call *call) {
+    long long time = read_uint();
+    if (call->enter_time < 0) {
+        call->enter_time = time;
+    } else {
+        call->leave_time = time;
+    }
+}
+
+void Parser::parse_arg(Call *call, Mode mode, int detail) {
     unsigned index = read_uint();
-    Value *value = parse_value(mode);
+    Value *value;
+    if (detail == trace::CALL_ARG) {
+        value = parse_value(mode);
+    } else {
+        value = parse_delta_value(call, index, mode, detail);
+    }
     if (value) {
         if (index >= call->args.size()) {
             call->args.resize(index + 1);
@@ -510,6 +713,78 @@ void Parser::parse_arg(Call *call, Mode mode) {
 }
 
 
+/**
+ * Update the argument reference, and parse the value from it.
+ *
+ * Only key values may contain signature definitions, so the others are not
+ * parsed at all unless needed.
+ */
+Value *Parser::parse_delta_value(Call *call, unsigned index, Mode mode, int detail) {
+    unsigned id = call->sig->id;
+    if (id >= argValues.size()) {
+        argValues.resize(id + 1);
+    }
+    ArgValues &values = argValues[id];
+    if (index >= values.size()) {
+        values.resize(index + 1);
+    }
+    std::string &reference = values[index];
+
+    File::Offset offset;
+
+    switch (detail) {
+    case trace::CALL_ARG_KEY:
+        {
+            size_t size = read_uint();
+            offset = file->currentOffset();
+            reference.resize(size);
+            if (size && file->read(&reference[0], size) != size) {
+                reference.clear();
+                return NULL;
+            }
+        }
+        break;
+    case trace::CALL_ARG_SAME:
+    case trace::CALL_ARG_DELTA:
+        if (reference.empty()) {
+            std::cerr << "error: (" << call->name() << ") argument " << index
+                      << " has no reference value\n";
+            exit(1);
+        }
+        offset = file->currentOffset();
+        if (detail == trace::CALL_ARG_DELTA) {
+            size_t size = reference.size();
+            for (size_t i = 0; i < size; i += 8) {
+                int mask = read_byte();
+                if (mask < 0) {
+                    return NULL;
+                }
+                size_t count = std::min(size - i, (size_t)8);
+                for (size_t j = 0; j < count; ++j) {
+                    if (mask & (1 << j)) {
+                        reference[i + j] ^= read_byte();
+                    }
+                }
+            }
+        }
+        if (mode != FULL) {
+            return NULL;
+        }
+        break;
+    default:
+        assert(0);
+        return NULL;
+    }
+
+    File *realFile = file;
+    BufferFile buffer(reference, offset);
+    file = &buffer;
+    Value *value = parse_value(mode);
+    file = realFile;
+    return value;
+}
+
+
 Value *Parser::parse_value(void) {
     int c;
     Value *value;
@@ -560,6 +835,15 @@ Value *Parser::parse_value(void) {
     case trace::TYPE_REPR:
         value = parse_repr();
         break;
+    case trace::TYPE_ELIDED:
+        value = parse_elided();
+        break;
+    case trace::TYPE_BLOB_KEY:
+        value = parse_blob_key();
+        break;
+    case trace::TYPE_BLOB_DELTA:
+        value = parse_blob_delta();
+        break;
     default:
         std::cerr << "error: unknown type " << c << "\n";
         exit(1);
@@ -619,6 +903,15 @@ void Parser::scan_value(void) {
     case trace::TYPE_REPR:
         scan_repr();
         break;
+    case trace::TYPE_ELIDED:
+        scan_elided();
+        break;
+    case trace::TYPE_BLOB_KEY:
+        scan_blob_key();
+        break;
+    case trace::TYPE_BLOB_DELTA:
+        scan_blob_delta();
+        break;
     default:
         std::cerr << "error: unknown type " << c << "\n";
         exit(1);
@@ -758,6 +1051,101 @@ void Parser::scan_blob(void) {
 }
 
 
+Value *Parser::parse_elided(void) {
+    size_t size = read_uint();
+    return new Elided(size);
+}
+
+
+void Parser::scan_elided(void) {
+    skip_uint();
+}
+
+
+static inline Value *
+make_blob(const std::string *bytes) {
+    if (!bytes) {
+        return NULL;
+    }
+    Blob *blob = new Blob(bytes->size());
+    memcpy(blob->buf, bytes->data(), bytes->size());
+    return blob;
+}
+
+
+/**
+ * Read a blob into its slot.  Blob references must be updated even when
+ * scanning, as later deltas depend on them.
+ */
+std::string *Parser::read_blob_key(void) {
+    size_t slot = read_uint();
+    size_t size = read_uint();
+    if (slot >= blobValues.size()) {
+        blobValues.resize(slot + 1);
+    }
+    std::string &bytes = blobValues[slot];
+    bytes.resize(size);
+    if (size && file->read(&bytes[0], size) != size) {
+        bytes.clear();
+        return NULL;
+    }
+    return &bytes;
+}
+
+
+Value *Parser::parse_blob_key(void) {
+    return make_blob(read_blob_key());
+}
+
+
+void Parser::scan_blob_key(void) {
+    read_blob_key();
+}
+
+
+std::string *Parser::read_blob_delta(void) {
+    size_t slot = read_uint();
+    if (slot >= blobValues.size() || blobValues[slot].empty()) {
+        std::cerr << "error: blob delta without reference\n";
+        exit(1);
+    }
+    std::string &bytes = blobValues[slot];
+    size_t size = bytes.size();
+    size_t i = 0;
+    while (i < size) {
+        size_t skip = read_uint();
+        size_t count = read_uint();
+        if (!skip && !count) {
+            // truncated
+            return NULL;
+        }
+        i += skip;
+        if (i + count > size) {
+            std::cerr << "error: blob delta out of bounds\n";
+            exit(1);
+        }
+        for (size_t end = i + count; i < end; ++i) {
+            int c = read_byte();
+            if (c == -1) {
+                return NULL;
+            }
+            bytes[i] ^= c;
+        }
+    }
+    return &bytes;
+}
+
+
+Value *Parser::parse_blob_delta(void) {
+    return make_blob(read_blob_delta());
+}
+
+
+void Parser::scan_blob_delta(void) {
+    read_blob_delta();
+}
+
+
 Value *Parser::parse_struct() {
     StructSig *sig = parse_struct_sig();
     Struct *value = new Struct(sig);
@@ -29,6 +29,8 @@
 
 #include <iostream>
 #include <list>
+#include <string>
+#include <vector>
 
 #include "trace_file.hpp"
 #include "trace_format.hpp"
@@ -43,6 +45,25 @@ struct ParseBookmark
 {
     File::Offset offset;
     unsigned next_call_no;
+
+    // Where delta encoding references were last reset, from which parsing
+    // must be replayed to reach the bookmark
+    File::Offset reset_offset;
+    unsigned reset_call_no;
+};
+
+
+/**
+ * Tells the parser which calls are of no interest beyond their number and
+ * flags, so that their arguments need not be parsed.
+ */
+class CallFilter
+{
+public:
+    virtual ~CallFilter() {}
+
+    virtual bool
+    skip(const FunctionSig *sig) const = 0;
 };
 
 
@@ -62,6 +83,7 @@ protected:
 
     struct FunctionSigFlags : public FunctionSig {
         CallFlags flags;
+        bool skip;
     };
 
     // Helper template that extends a base signature structure, with additional
@@ -91,18 +113,43 @@ protected:
 
     FunctionSig *glGetErrorSig;
 
+    const CallFilter *filter;
+
+    // Reference bytes of delta encoded arguments, indexed by function
+    // signature id and argument index
+    typedef std::vector<std::string> ArgValues;
+    std::vector<ArgValues> argValues;
+
+    // Reference blobs, indexed by slot
+    std::vector<std::string> blobValues;
+
+    // Last point where there were no references
+    bool resetPending;
+    File::Offset resetOffset;
+    unsigned resetCallNo;
+
+    void resetReferences(void);
+
     unsigned next_call_no;
 
 public:
     unsigned long long version;
     API api;
 
+    // Tracer statistics, once parsed
+    StatList stats;
+
     Parser();
 
     ~Parser();
 
     bool open(const char *filename);
 
+    /**
+     * Parse an already opened file, taking ownership of it.
+     */
+    bool open(File *file);
+
     void close(void);
 
     Call *parse_call(void) {
@@ -127,6 +174,15 @@ public:
         return parse_call(SCAN);
     }
 
+    static CallFlags
+    lookupCallFlags(const char *name);
+
+    /**
+     * Calls rejected by the filter are still returned, but without
+     * arguments or return value.
+     */
+    void setCallFilter(const CallFilter *filter);
+
 protected:
     Call *parse_call(Mode mode);
 
@@ -135,21 +191,24 @@ protected:
     EnumSig *parse_old_enum_sig();
     EnumSig *parse_enum_sig();
     BitmaskSig *parse_bitmask_sig();
-    
-    static CallFlags
-    lookupCallFlags(const char *name);
 
     Call *parse_Call(Mode mode);
 
     void parse_enter(Mode mode);
 
+    void parse_stats(void);
+
     Call *parse_leave(Mode mode);
 
     bool parse_call_details(Call *call, Mode mode);
 
     void adjust_call_flags(Call *call);
 
-    void parse_arg(Call *call, Mode mode);
+    void parse_time(Call *call);
+
+    void parse_arg(Call *call, Mode mode, int detail);
+
+    Value *parse_delta_value(Call *call, unsigned index, Mode mode, int detail);
 
     Value *parse_value(void);
     void scan_value(void);
@@ -189,6 +248,17 @@ protected:
     Value *parse_blob(void);
     void scan_blob(void);
 
+    Value *parse_elided(void);
+    void scan_elided(void);
+
+    std::string *read_blob_key(void);
+    Value *parse_blob_key(void);
+    void scan_blob_key(void);
+
+    std::string *read_blob_delta(void);
+    Value *parse_blob_delta(void);
+    void scan_blob_delta(void);
+
     Value *parse_struct();
     void scan_struct();
 
@@ -30,17 +30,40 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <algorithm>
+
 #include "os.hpp"
 #include "trace_file.hpp"
 #include "trace_writer.hpp"
 #include "trace_format.hpp"
+#include "trace_parser.hpp"
 
 
 namespace trace {
 
 
+// Arguments larger than this are not delta encoded
+static const size_t MAX_DELTA_ARG_SIZE = 1024;
+
+// Frame terminators between forgetting all references
+static const unsigned DELTA_RESET_FRAMES = 16;
+
+// Blobs smaller than this are not delta encoded
+static const size_t MIN_DELTA_BLOB_SIZE = 128;
+
+// Maximum amount of blob references kept (on both ends)
+static const size_t MAX_DELTA_BLOB_BYTES = 64*1024*1024;
+
+
 Writer::Writer() :
-    call_no(0)
+    call_no(0),
+    bytes_written(0),
+    enterSig(NULL),
+    argBuffering(false),
+    argHasSig(false),
+    argIndex(0),
+    frameCount(0),
+    blobBytes(0)
 {
     m_file = File::createSnappy();
     close();
@@ -67,11 +90,20 @@ Writer::open(const char *filename) {
     }
 
     call_no = 0;
+    bytes_written = 0;
     functions.clear();
     structs.clear();
     enums.clear();
     bitmasks.clear();
 
+    enterSig = NULL;
+    argBuffering = false;
+    argBuffer.clear();
+    frameFunctions.clear();
+    pendingFrameCalls.clear();
+    frameCount = 0;
+    _resetReferences();
+
     _writeUInt(TRACE_VERSION);
 
     return true;
@@ -79,7 +111,12 @@ Writer::open(const char *filename) {
 
 void inline
 Writer::_write(const void *sBuffer, size_t dwBytesToWrite) {
+    if (argBuffering) {
+        _bufferArg(sBuffer, dwBytesToWrite);
+        return;
+    }
     m_file->write(sBuffer, dwBytesToWrite);
+    bytes_written += dwBytesToWrite;
 }
 
 void inline
@@ -145,29 +182,183 @@ unsigned Writer::beginEnter(const FunctionSig *sig, unsigned thread_id) {
             _writeString(sig->arg_names[i]);
         }
         functions[sig->id] = true;
+
+        lookup(frameFunctions, sig->id);
+        frameFunctions[sig->id] = Parser::lookupCallFlags(sig->name) & CALL_FLAG_END_FRAME;
+    }
+
+    if (frameFunctions[sig->id]) {
+        pendingFrameCalls.push_back(call_no);
     }
 
+    enterSig = sig;
+
     return call_no++;
 }
 
 void Writer::endEnter(void) {
+    if (argBuffering) {
+        _endArg();
+    }
+    enterSig = NULL;
     _writeByte(trace::CALL_END);
 }
 
 void Writer::beginLeave(unsigned call) {
     _writeByte(trace::EVENT_LEAVE);
     _writeUInt(call);
+
+    if (!pendingFrameCalls.empty()) {
+        std::vector<unsigned>::iterator it;
+        it = std::find(pendingFrameCalls.begin(), pendingFrameCalls.end(), call);
+        if (it != pendingFrameCalls.end()) {
+            // Frame boundary -- periodically forget all references so that
+            // the parser can start decoding from here
+            pendingFrameCalls.erase(it);
+            if (++frameCount % DELTA_RESET_FRAMES == 0) {
+                _writeByte(trace::CALL_ARG_RESET);
+                _resetReferences();
+            }
+        }
+    }
+}
+
+void Writer::writeStats(const StatList &stats) {
+    _writeByte(trace::EVENT_STATS);
+    _writeUInt(stats.size());
+    for (StatList::const_iterator it = stats.begin(); it != stats.end(); ++it) {
+        _writeString(it->first.c_str());
+        _writeUInt(it->second);
+    }
 }
 
 void Writer::endLeave(void) {
     _writeByte(trace::CALL_END);
 }
 
+void Writer::writeTime(unsigned long long time) {
+    _writeByte(trace::CALL_TIME);
+    _writeUInt(time);
+}
+
 void Writer::beginArg(unsigned index) {
+    if (argBuffering) {
+        _endArg();
+    }
+
+    if (enterSig) {
+        argBuffering = true;
+        argHasSig = false;
+        argIndex = index;
+        argBuffer.clear();
+        return;
+    }
+
     _writeByte(trace::CALL_ARG);
     _writeUInt(index);
 }
 
+void Writer::endArg(void) {
+    if (argBuffering) {
+        _endArg();
+    }
+}
+
+void
+Writer::_bufferArg(const void *sBuffer, size_t dwBytesToWrite) {
+    if (argBuffer.size() + dwBytesToWrite > MAX_DELTA_ARG_SIZE) {
+        _flushArg();
+        _write(sBuffer, dwBytesToWrite);
+        return;
+    }
+    argBuffer.append((const char *)sBuffer, dwBytesToWrite);
+}
+
+/*
+ * Write the argument buffered so far verbatim, and stream the remainder.  The
+ * reference is left untouched, on both ends.
+ */
+void
+Writer::_flushArg(void) {
+    argBuffering = false;
+    _writeByte(trace::CALL_ARG);
+    _writeUInt(argIndex);
+    _write(argBuffer.data(), argBuffer.size());
+    argBuffer.clear();
+}
+
+void
+Writer::_endArg(void) {
+    argBuffering = false;
+
+    if (enterSig->id >= argValues.size()) {
+        argValues.resize(enterSig->id + 1);
+    }
+    ArgValues &values = argValues[enterSig->id];
+    if (argIndex >= values.size()) {
+        values.resize(argIndex + 1);
+    }
+    std::string &reference = values[argIndex];
+
+    const char *bytes = argBuffer.data();
+    size_t size = argBuffer.size();
+
+    // Values with signature definitions must be kept verbatim, as these are
+    // only parsed once
+    if (!argHasSig && reference.size() == size) {
+        const char *ref = reference.data();
+        if (memcmp(bytes, ref, size) == 0) {
+            _writeByte(trace::CALL_ARG_SAME);
+            _writeUInt(argIndex);
+            argBuffer.clear();
+            return;
+        }
+
+        size_t changed = 0;
+        for (size_t i = 0; i < size; ++i) {
+            changed += bytes[i] != ref[i];
+        }
+
+        if (changed + (size + 7)/8 < size) {
+            _writeByte(trace::CALL_ARG_DELTA);
+            _writeUInt(argIndex);
+            for (size_t i = 0; i < size; i += 8) {
+                size_t count = std::min(size - i, (size_t)8);
+                char group[1 + 8];
+                unsigned len = 1;
+                unsigned char mask = 0;
+                for (size_t j = 0; j < count; ++j) {
+                    char delta = bytes[i + j] ^ ref[i + j];
+                    if (delta) {
+                        mask |= 1 << j;
+                        group[len++] = delta;
+                    }
+                }
+                group[0] = mask;
+                _write(group, len);
+            }
+            reference.swap(argBuffer);
+            argBuffer.clear();
+            return;
+        }
+    }
+
+    _writeByte(trace::CALL_ARG_KEY);
+    _writeUInt(argIndex);
+    _writeUInt(size);
+    _write(bytes, size);
+    reference.swap(argBuffer);
+    argBuffer.clear();
+}
+
+void
+Writer::_resetReferences(void) {
+    argValues.clear();
+    blobSlots.clear();
+    blobValues.clear();
+    blobBytes = 0;
+}
+
 void Writer::beginReturn(void) {
     _writeByte(trace::CALL_RET);
 }
@@ -187,6 +378,7 @@ void Writer::beginStruct(const StructSig *sig) {
             _writeString(sig->member_names[i]);
         }
         structs[sig->id] = true;
+        argHasSig = true;
     }
 }
 
@@ -263,6 +455,121 @@ void Writer::writeBlob(const void *data, size_t size) {
     }
 }
 
+static inline void
+appendUInt(std::string &s, unsigned long long value) {
+    do {
+        char c = value & 0x7f;
+        value >>= 7;
+        if (value) {
+            c |= 0x80;
+        }
+        s += c;
+    } while (value);
+}
+
+/*
+ * Encode the data as runs of unchanged bytes and XORed changed bytes, into
+ * blobDelta.  Returns false if that wouldn't save at least half the size.
+ */
+bool
+Writer::_encodeBlobDelta(const std::string &reference, const void *data, size_t size) {
+    const unsigned char *src = (const unsigned char *)data;
+    const unsigned char *ref = (const unsigned char *)reference.data();
+    size_t limit = size / 2;
+
+    blobDelta.clear();
+
+    size_t i = 0;
+    while (i < size) {
+        size_t start = i;
+        while (i + 8 <= size && memcmp(src + i, ref + i, 8) == 0) {
+            i += 8;
+        }
+        while (i < size && src[i] == ref[i]) {
+            ++i;
+        }
+        appendUInt(blobDelta, i - start);
+
+        // Swallow short unchanged gaps, as restarting a run costs more
+        start = i;
+        size_t end = i;
+        while (i < size) {
+            if (src[i] != ref[i]) {
+                end = ++i;
+            } else if (i - end < 2) {
+                ++i;
+            } else {
+                break;
+            }
+        }
+        i = end;
+        appendUInt(blobDelta, end - start);
+        for (size_t j = start; j < end; ++j) {
+            blobDelta += (char)(src[j] ^ ref[j]);
+        }
+
+        if (blobDelta.size() > limit) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void Writer::writeBlobDelta(unsigned long long object, unsigned long long offset,
+                            const void *data, size_t size) {
+    if (!data || size < MIN_DELTA_BLOB_SIZE) {
+        Writer::writeBlob(data, size);
+        return;
+    }
+
+    // Blob references must be updated exactly once by the parser, so the
+    // argument can't be delta encoded itself
+    if (argBuffering) {
+        _flushArg();
+    }
+
+    BlobKey key;
+    key.object = object;
+    key.offset = offset;
+    key.size = size;
+
+    BlobSlotMap::iterator it = blobSlots.find(key);
+    unsigned slot;
+    if (it != blobSlots.end()) {
+        slot = it->second;
+        std::string &reference = blobValues[slot];
+        assert(reference.size() == size);
+        if (_encodeBlobDelta(reference, data, size)) {
+            _writeByte(trace::TYPE_BLOB_DELTA);
+            _writeUInt(slot);
+            _write(blobDelta.data(), blobDelta.size());
+            reference.assign((const char *)data, size);
+            return;
+        }
+        reference.assign((const char *)data, size);
+    } else {
+        if (blobBytes + size > MAX_DELTA_BLOB_BYTES) {
+            Writer::writeBlob(data, size);
+            return;
+        }
+        slot = blobValues.size();
+        blobValues.push_back(std::string((const char *)data, size));
+        blobBytes += size;
+        blobSlots[key] = slot;
+    }
+
+    _writeByte(trace::TYPE_BLOB_KEY);
+    _writeUInt(slot);
+    _writeUInt(size);
+    _write(data, size);
+}
+
+void Writer::writeElided(size_t size) {
+    _writeByte(trace::TYPE_ELIDED);
+    _writeUInt(size);
+}
+
 void Writer::writeEnum(const EnumSig *sig, signed long long value) {
     _writeByte(trace::TYPE_ENUM);
     _writeUInt(sig->id);
@@ -273,6 +580,7 @@ void Writer::writeEnum(const EnumSig *sig, signed long long value) {
             writeSInt(sig->values[i].value);
         }
         enums[sig->id] = true;
+        argHasSig = true;
     }
     writeSInt(value);
 }
@@ -290,6 +598,7 @@ void Writer::writeBitmask(const BitmaskSig *sig, unsigned long long value) {
             _writeUInt(sig->flags[i].value);
         }
         bitmasks[sig->id] = true;
+        argHasSig = true;
     }
     _writeUInt(value);
 }
@@ -33,6 +33,8 @@
 
 #include <stddef.h>
 
+#include <map>
+#include <string>
 #include <vector>
 
 #include "trace_model.hpp"
@@ -45,12 +47,60 @@ namespace trace {
     protected:
         File *m_file;
         unsigned call_no;
+        unsigned long long bytes_written;
 
         std::vector<bool> functions;
         std::vector<bool> structs;
         std::vector<bool> enums;
         std::vector<bool> bitmasks;
 
+        /**
+         * Delta encoding of call arguments.
+         *
+         * Arguments of the call being entered are buffered, and compared
+         * against the last value recorded for the same function and argument
+         * index.  References are forgotten every few frame terminators, which
+         * bounds how much the parser needs to replay when seeking.
+         */
+        const FunctionSig *enterSig;
+        bool argBuffering;
+        bool argHasSig;
+        unsigned argIndex;
+        std::string argBuffer;
+
+        typedef std::vector<std::string> ArgValues;
+        std::vector<ArgValues> argValues;
+
+        std::vector<bool> frameFunctions;
+        std::vector<unsigned> pendingFrameCalls;
+        unsigned frameCount;
+
+        /**
+         * Delta encoding of blobs, keyed by the object and range they update.
+         */
+        struct BlobKey {
+            unsigned long long object;
+            unsigned long long offset;
+            size_t size;
+
+            bool
+            operator < (const BlobKey &other) const {
+                if (object != other.object) {
+                    return object < other.object;
+                }
+                if (offset != other.offset) {
+                    return offset < other.offset;
+                }
+                return size < other.size;
+            }
+        };
+
+        typedef std::map<BlobKey, unsigned> BlobSlotMap;
+        BlobSlotMap blobSlots;
+        std::vector<std::string> blobValues;
+        size_t blobBytes;
+        std::string blobDelta;
+
     public:
         Writer();
         ~Writer();
@@ -64,8 +114,10 @@ namespace trace {
         void beginLeave(unsigned call);
         void endLeave(void);
 
+        void writeTime(unsigned long long time);
+
         void beginArg(unsigned index);
-        inline void endArg(void) {}
+        void endArg(void);
 
         void beginReturn(void);
         inline void endReturn(void) {}
@@ -91,6 +143,9 @@ namespace trace {
         void writeString(const char *str, size_t size);
         void writeWString(const wchar_t *str);
         void writeBlob(const void *data, size_t size);
+        void writeBlobDelta(unsigned long long object, unsigned long long offset,
+                            const void *data, size_t size);
+        void writeElided(size_t size);
         void writeEnum(const EnumSig *sig, signed long long value);
         void writeBitmask(const BitmaskSig *sig, unsigned long long value);
         void writeNull(void);
@@ -98,6 +153,8 @@ namespace trace {
 
         void writeCall(Call *call);
 
+        void writeStats(const StatList &stats);
+
     protected:
         void inline _write(const void *sBuffer, size_t dwBytesToWrite);
         void inline _writeByte(char c);
@@ -106,6 +163,12 @@ namespace trace {
         void inline _writeDouble(double value);
         void inline _writeString(const char *str);
 
+        void _bufferArg(const void *sBuffer, size_t dwBytesToWrite);
+        void _flushArg(void);
+        void _endArg(void);
+        void _resetReferences(void);
+        bool _encodeBlobDelta(const std::string &reference, const void *data, size_t size);
+
     };
 
 } /* namespace trace */
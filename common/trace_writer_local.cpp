@@ -30,9 +30,13 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <algorithm>
+#include <functional>
+
 #include "os.hpp"
 #include "os_thread.hpp"
 #include "os_string.hpp"
+#include "os_time.hpp"
 #include "trace_file.hpp"
 #include "trace_writer_local.hpp"
 #include "trace_format.hpp"
@@ -61,16 +65,58 @@ static void exceptionCallback(void)
 
 
 LocalWriter::LocalWriter() :
-    acquired(0)
+    acquired(0),
+    stopped(false),
+    frameNo(0),
+    lastFrame(0),
+    timeline(false),
+    startTime(0),
+    stats(false),
+    eventSig(NULL),
+    eventBytes(0),
+    blobBytes(0),
+    lockWaits(0),
+    lockWaitTime(0),
+    statsInterval(0),
+    statsTime(0),
+    statsCalls(0)
 {
     // Install the signal handlers as early as possible, to prevent
     // interfering with the application's signal handling.
     os::setExceptionCallback(exceptionCallback);
+
+    const char *frames = getenv("TRACE_FRAMES");
+    if (frames) {
+        char *end = NULL;
+        unsigned long count = strtoul(frames, &end, 10);
+        if (end == frames || *end != '\0' || count == 0) {
+            os::log("apitrace: warning: ignoring invalid TRACE_FRAMES=%s\n", frames);
+        } else {
+            lastFrame = (unsigned)count;
+        }
+    }
+
+    if (getenv("TRACE_TIMELINE")) {
+        timeline = true;
+    }
+
+    if (getenv("TRACE_STATS")) {
+        stats = true;
+    }
+
+    const char *interval = getenv("TRACE_STATS_INTERVAL");
+    if (interval) {
+        stats = true;
+        // Must be called before using timeFrequency
+        statsTime = os::getTime();
+        statsInterval = (long long)(atof(interval) * os::timeFrequency);
+    }
 }
 
 LocalWriter::~LocalWriter()
 {
     os::resetExceptionCallback();
+    close();
 }
 
 void
@@ -122,20 +168,56 @@ LocalWriter::open(void) {
         os::abort();
     }
 
+    startTime = os::getTime();
+
+    functionStats.clear();
+    pendingCalls.clear();
+    blobBytes = 0;
+    lockWaits = 0;
+    lockWaitTime = 0;
+
 #if 0
     // For debugging the exception handler
     *((int *)0) = 0;
 #endif
 }
 
+void
+LocalWriter::close(void) {
+    if (stats && m_file->isOpened()) {
+        // Account for the last chunk too
+        m_file->flush();
+        _logStats("final");
+        _writeStats();
+    }
+    Writer::close();
+}
+
 static unsigned next_thread_id = 0;
 static os::thread_specific_ptr<unsigned> thread_id_specific_ptr;
 
+/*
+ * Lock the mutex, measuring how long it was waited for, if contended.
+ */
+void LocalWriter::_lock(void) {
+    if (!stats) {
+        mutex.lock();
+        return;
+    }
+
+    if (!mutex.try_lock()) {
+        long long waitStart = os::getTime();
+        mutex.lock();
+        lockWaitTime += os::getTime() - waitStart;
+        ++lockWaits;
+    }
+}
+
 unsigned LocalWriter::beginEnter(const FunctionSig *sig) {
-    mutex.lock();
+    _lock();
     ++acquired;
 
-    if (!m_file->isOpened()) {
+    if (!m_file->isOpened() && !stopped) {
         open();
     }
 
@@ -150,27 +232,187 @@ unsigned LocalWriter::beginEnter(const FunctionSig *sig) {
         thread_id_specific_ptr.reset(thread_id_ptr);
     }
 
-    return Writer::beginEnter(sig, thread_id);
+    if (stats) {
+        if (sig->id >= functionStats.size()) {
+            FunctionStats empty = {NULL, 0, 0};
+            functionStats.resize(sig->id + 1, empty);
+        }
+        functionStats[sig->id].sig = sig;
+        ++functionStats[sig->id].calls;
+        eventSig = sig;
+        eventBytes = bytes_written;
+    }
+
+    unsigned call = Writer::beginEnter(sig, thread_id);
+    if (timeline) {
+        _writeTime();
+    }
+
+    if (stats) {
+        pendingCalls.push_back(std::make_pair(call, sig));
+    }
+
+    return call;
 }
 
 void LocalWriter::endEnter(void) {
     Writer::endEnter();
+    if (stats) {
+        _countBytes();
+    }
     --acquired;
     mutex.unlock();
 }
 
 void LocalWriter::beginLeave(unsigned call) {
-    mutex.lock();
+    _lock();
     ++acquired;
+
+    if (stats) {
+        eventSig = NULL;
+        for (size_t i = pendingCalls.size(); i-- > 0; ) {
+            if (pendingCalls[i].first == call) {
+                eventSig = pendingCalls[i].second;
+                pendingCalls.erase(pendingCalls.begin() + i);
+                break;
+            }
+        }
+        eventBytes = bytes_written;
+    }
+
     Writer::beginLeave(call);
+    if (timeline) {
+        _writeTime();
+    }
+}
+
+void LocalWriter::_writeTime(void) {
+    long long time = os::getTime() - startTime;
+    writeTime((unsigned long long)(time * (1.0e9 / os::timeFrequency)));
+}
+
+void LocalWriter::writeBlob(const void *data, size_t size) {
+    if (stats && data) {
+        blobBytes += size;
+    }
+    if (timeline && data) {
+        writeElided(size);
+    } else {
+        Writer::writeBlob(data, size);
+    }
+}
+
+void LocalWriter::writeBlobDelta(unsigned long long object, unsigned long long offset,
+                                 const void *data, size_t size) {
+    if (stats && data) {
+        blobBytes += size;
+    }
+    if (timeline && data) {
+        writeElided(size);
+    } else {
+        Writer::writeBlobDelta(object, offset, data, size);
+    }
 }
 
 void LocalWriter::endLeave(void) {
     Writer::endLeave();
+
+    if (stats) {
+        _countBytes();
+
+        // Avoid querying the time on every call
+        if (statsInterval && ++statsCalls >= 1024) {
+            statsCalls = 0;
+            long long now = os::getTime();
+            if (now - statsTime >= statsInterval) {
+                statsTime = now;
+                _logStats("periodic");
+            }
+        }
+    }
+
     --acquired;
     mutex.unlock();
 }
 
+void LocalWriter::_countBytes(void) {
+    if (eventSig) {
+        functionStats[eventSig->id].bytes += bytes_written - eventBytes;
+    }
+}
+
+void LocalWriter::_logStats(const char *reason) {
+    double frequency = (double)os::timeFrequency;
+    const File::Stats &fileStats = m_file->stats();
+
+    unsigned long long calls = 0;
+    std::vector< std::pair<unsigned long long, size_t> > order;
+    for (size_t i = 0; i < functionStats.size(); ++i) {
+        if (functionStats[i].sig) {
+            calls += functionStats[i].calls;
+            order.push_back(std::make_pair(functionStats[i].bytes, i));
+        }
+    }
+
+    os::log("apitrace: %s statistics: %llu calls, %llu bytes, %llu blob bytes\n",
+            reason, calls, bytes_written, blobBytes);
+    os::log("apitrace:   %llu chunks, %llu compressed bytes, %.3f s compressing, %.3f s writing, %.3f ms max flush\n",
+            (unsigned long long)fileStats.chunks,
+            (unsigned long long)fileStats.compressedBytes,
+            fileStats.compressTime / frequency,
+            fileStats.writeTime / frequency,
+            fileStats.maxFlushTime * 1.0e3 / frequency);
+    os::log("apitrace:   %llu contended locks, %.3f s waiting\n",
+            lockWaits, lockWaitTime / frequency);
+
+    // Functions which contributed the most bytes
+    std::sort(order.begin(), order.end(), std::greater< std::pair<unsigned long long, size_t> >());
+    size_t count = std::min(order.size(), (size_t)16);
+    for (size_t i = 0; i < count; ++i) {
+        const FunctionStats &function = functionStats[order[i].second];
+        os::log("apitrace:   %12llu bytes %10llu calls  %s\n",
+                function.bytes, function.calls, function.sig->name);
+    }
+}
+
+/*
+ * Record the statistics at the end of the trace, with times in nanoseconds.
+ * The chunk statistics don't include the chunk with the record itself.
+ */
+void LocalWriter::_writeStats(void) {
+    double toNanoseconds = 1.0e9 / os::timeFrequency;
+    const File::Stats &fileStats = m_file->stats();
+
+    StatList list;
+    unsigned long long calls = 0;
+    for (size_t i = 0; i < functionStats.size(); ++i) {
+        if (functionStats[i].sig) {
+            calls += functionStats[i].calls;
+        }
+    }
+    list.push_back(std::make_pair(std::string("calls"), calls));
+    list.push_back(std::make_pair(std::string("bytes"), bytes_written));
+    list.push_back(std::make_pair(std::string("blob_bytes"), blobBytes));
+    list.push_back(std::make_pair(std::string("chunks"), (unsigned long long)fileStats.chunks));
+    list.push_back(std::make_pair(std::string("compressed_bytes"), (unsigned long long)fileStats.compressedBytes));
+    list.push_back(std::make_pair(std::string("compress_time"), (unsigned long long)(fileStats.compressTime * toNanoseconds)));
+    list.push_back(std::make_pair(std::string("write_time"), (unsigned long long)(fileStats.writeTime * toNanoseconds)));
+    list.push_back(std::make_pair(std::string("max_flush_time"), (unsigned long long)(fileStats.maxFlushTime * toNanoseconds)));
+    list.push_back(std::make_pair(std::string("lock_waits"), lockWaits));
+    list.push_back(std::make_pair(std::string("lock_wait_time"), (unsigned long long)(lockWaitTime * toNanoseconds)));
+
+    for (size_t i = 0; i < functionStats.size(); ++i) {
+        const FunctionStats &function = functionStats[i];
+        if (function.sig) {
+            std::string name = function.sig->name;
+            list.push_back(std::make_pair(name + ".calls", function.calls));
+            list.push_back(std::make_pair(name + ".bytes", function.bytes));
+        }
+    }
+
+    writeStats(list);
+}
+
 void LocalWriter::flush(void) {
     /*
      * Do nothing if the mutex is already acquired (e.g., if a segfault happen
@@ -193,6 +435,23 @@ void LocalWriter::flush(void) {
 }
 
 
+void LocalWriter::endFrame(void) {
+    if (!lastFrame) {
+        return;
+    }
+
+    mutex.lock();
+    ++frameNo;
+    if (frameNo == lastFrame && !stopped) {
+        os::log("apitrace: closing trace after frame %u\n", lastFrame);
+        // All subsequent calls will not be recorded
+        stopped = true;
+        close();
+    }
+    mutex.unlock();
+}
+
+
 LocalWriter localWriter;
 
 
@@ -33,6 +33,12 @@
 
 #include <stdint.h>
 
+#ifndef _WIN32
+#include <signal.h>
+#endif
+
+#include <vector>
+
 #include "os_thread.hpp"
 #include "trace_writer.hpp"
 
@@ -61,6 +67,53 @@ namespace trace {
         os::recursive_mutex mutex;
         int acquired;
 
+        /**
+         * Frame limit (TRACE_FRAMES), after which the trace is closed, and
+         * no further calls are recorded.  Zero if unlimited.
+         */
+        bool stopped;
+        unsigned frameNo;
+        unsigned lastFrame;
+
+        /**
+         * Timeline mode (TRACE_TIMELINE), where calls are timestamped, and
+         * blob/array contents are elided.
+         */
+        bool timeline;
+        long long startTime;
+
+        void _writeTime(void);
+
+        /**
+         * Tracing statistics (TRACE_STATS), to measure the cost of tracing
+         * itself.  Recorded at the end of the trace, and logged when the
+         * trace is closed and periodically every TRACE_STATS_INTERVAL
+         * seconds, if set.
+         */
+        struct FunctionStats {
+            const FunctionSig *sig;
+            unsigned long long calls;
+            unsigned long long bytes;
+        };
+
+        bool stats;
+        std::vector<FunctionStats> functionStats;
+        // Calls entered but not left yet, and their signatures
+        std::vector< std::pair<unsigned, const FunctionSig *> > pendingCalls;
+        const FunctionSig *eventSig;
+        unsigned long long eventBytes;
+        unsigned long long blobBytes;
+        unsigned long long lockWaits;
+        long long lockWaitTime;
+        long long statsInterval;
+        long long statsTime;
+        unsigned statsCalls;
+
+        void _lock(void);
+        void _countBytes(void);
+        void _logStats(const char *reason);
+        void _writeStats(void);
+
     public:
         /**
          * Should never called directly -- use localWriter singleton below instead.
@@ -69,6 +122,7 @@ namespace trace {
         ~LocalWriter();
 
         void open(void);
+        void close(void);
 
         unsigned beginEnter(const FunctionSig *sig);
         void endEnter(void);
@@ -77,6 +131,20 @@ namespace trace {
         void endLeave(void);
 
         void flush(void);
+
+        inline bool
+        isTimeline(void) const {
+            return timeline;
+        }
+
+        void writeBlob(const void *data, size_t size);
+        void writeBlobDelta(unsigned long long object, unsigned long long offset,
+                            const void *data, size_t size);
+
+        /**
+         * Called by the wrappers on every frame terminator.
+         */
+        void endFrame(void);
     };
 
     /**
@@ -96,6 +96,10 @@ public:
         writer.writeBlob(node->buf, node->size);
     }
 
+    void visit(Elided *node) {
+        writer.writeElided(node->size);
+    }
+
     void visit(Pointer *node) {
         writer.writePointer(node->value);
     }
@@ -109,6 +113,9 @@ public:
 
     void visit(Call *call) {
         unsigned call_no = writer.beginEnter(call->sig, call->thread_id);
+        if (call->enter_time >= 0) {
+            writer.writeTime(call->enter_time);
+        }
         for (unsigned i = 0; i < call->args.size(); ++i) {
             if (call->args[i].value) {
                 writer.beginArg(i);
@@ -118,6 +125,9 @@ public:
         }
         writer.endEnter();
         writer.beginLeave(call_no);
+        if (call->leave_time >= 0) {
+            writer.writeTime(call->leave_time);
+        }
         if (call->ret) {
             writer.beginReturn();
             _visit(call->ret);
@@ -222,6 +222,11 @@ void VariantVisitor::visit(trace::Blob *blob)
     m_variant = QVariant(barray);
 }
 
+void VariantVisitor::visit(trace::Elided *elided)
+{
+    m_variant = QVariant(QString("elided(%1)").arg((qulonglong)elided->size));
+}
+
 void VariantVisitor::visit(trace::Pointer *ptr)
 {
     m_variant = QVariant::fromValue(ApiPointer(ptr->value));
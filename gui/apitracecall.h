@@ -32,6 +32,7 @@ public:
     virtual void visit(trace::Struct *str);
     virtual void visit(trace::Array *array);
     virtual void visit(trace::Blob *blob);
+    virtual void visit(trace::Elided *elided);
     virtual void visit(trace::Pointer *ptr);
     virtual void visit(trace::Repr *ptr);
 
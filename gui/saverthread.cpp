@@ -294,6 +294,11 @@ public:
         m_editedValue = blob;
     }
 
+    virtual void visit(trace::Elided *elided)
+    {
+        m_editedValue = elided;
+    }
+
     virtual void visit(trace::Pointer *ptr)
     {
         m_editedValue = ptr;
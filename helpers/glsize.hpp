@@ -42,6 +42,11 @@
 #include "os.hpp"
 #include "glimports.hpp"
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define _GL_SIZE_SSE2 1
+#include <emmintrin.h>
+#endif
+
 
 static inline size_t
 _gl_type_size(GLenum type)
@@ -332,63 +337,155 @@ _glDrawArrays_count(GLint first, GLsizei count)
 
 #define _glDrawArraysEXT_count _glDrawArrays_count
 
+/*
+ * Maximum index, for each index type.
+ *
+ * These are hot for mesh-heavy applications, as they are run on every indexed
+ * draw with user arrays, so use SSE2 when available.  SSE2 only has unsigned
+ * byte and signed word/dword comparisons, so the sign bit is flipped for the
+ * wider types.
+ */
+
+static inline GLuint
+_gl_max_index_ubyte(const GLubyte *p, GLsizei count)
+{
+    GLubyte maxindex = 0;
+    GLsizei i = 0;
+#ifdef _GL_SIZE_SSE2
+    if (count >= 16) {
+        __m128i vmax = _mm_setzero_si128();
+        for (; i + 16 <= count; i += 16) {
+            vmax = _mm_max_epu8(vmax, _mm_loadu_si128((const __m128i *)(p + i)));
+        }
+        GLubyte lanes[16];
+        _mm_storeu_si128((__m128i *)lanes, vmax);
+        for (unsigned j = 0; j < 16; ++j) {
+            maxindex = std::max(maxindex, lanes[j]);
+        }
+    }
+#endif
+    for (; i < count; ++i) {
+        maxindex = std::max(maxindex, p[i]);
+    }
+    return maxindex;
+}
+
+static inline GLuint
+_gl_max_index_ushort(const GLushort *p, GLsizei count)
+{
+    GLushort maxindex = 0;
+    GLsizei i = 0;
+#ifdef _GL_SIZE_SSE2
+    if (count >= 8) {
+        const __m128i bias = _mm_set1_epi16((short)0x8000);
+        __m128i vmax = bias;
+        for (; i + 8 <= count; i += 8) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+            vmax = _mm_max_epi16(vmax, _mm_xor_si128(v, bias));
+        }
+        GLushort lanes[8];
+        _mm_storeu_si128((__m128i *)lanes, _mm_xor_si128(vmax, bias));
+        for (unsigned j = 0; j < 8; ++j) {
+            maxindex = std::max(maxindex, lanes[j]);
+        }
+    }
+#endif
+    for (; i < count; ++i) {
+        maxindex = std::max(maxindex, p[i]);
+    }
+    return maxindex;
+}
+
+static inline GLuint
+_gl_max_index_uint(const GLuint *p, GLsizei count)
+{
+    GLuint maxindex = 0;
+    GLsizei i = 0;
+#ifdef _GL_SIZE_SSE2
+    if (count >= 4) {
+        const __m128i bias = _mm_set1_epi32((int)0x80000000);
+        __m128i vmax = bias;
+        for (; i + 4 <= count; i += 4) {
+            __m128i v = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(p + i)), bias);
+            __m128i gt = _mm_cmpgt_epi32(v, vmax);
+            vmax = _mm_or_si128(_mm_and_si128(gt, v), _mm_andnot_si128(gt, vmax));
+        }
+        GLuint lanes[4];
+        _mm_storeu_si128((__m128i *)lanes, _mm_xor_si128(vmax, bias));
+        for (unsigned j = 0; j < 4; ++j) {
+            maxindex = std::max(maxindex, lanes[j]);
+        }
+    }
+#endif
+    for (; i < count; ++i) {
+        maxindex = std::max(maxindex, p[i]);
+    }
+    return maxindex;
+}
+
+static inline GLuint
+_gl_max_index(GLenum type, const GLvoid *indices, GLsizei count)
+{
+    switch (type) {
+    case GL_UNSIGNED_BYTE:
+        return _gl_max_index_ubyte((const GLubyte *)indices, count);
+    case GL_UNSIGNED_SHORT:
+        return _gl_max_index_ushort((const GLushort *)indices, count);
+    case GL_UNSIGNED_INT:
+        return _gl_max_index_uint((const GLuint *)indices, count);
+    default:
+        os::log("apitrace: warning: %s: unknown GLenum 0x%04X\n", __FUNCTION__, type);
+        return 0;
+    }
+}
+
+/*
+ * Read back indices from the bound element array buffer, and find the
+ * maximum.
+ */
+static inline GLuint
+_glElementArrayBuffer_max_index(GLintptr offset, GLsizei count, GLenum type)
+{
+    GLsizeiptr size = count*_gl_type_size(type);
+    GLvoid *temp = malloc(size);
+    if (!temp) {
+        return 0;
+    }
+    memset(temp, 0, size);
+    _glGetBufferSubData(GL_ELEMENT_ARRAY_BUFFER, offset, size, temp);
+    GLuint maxindex = _gl_max_index(type, temp, count);
+    free(temp);
+    return maxindex;
+}
+
+namespace gltrace {
+    /*
+     * Cached version of _glElementArrayBuffer_max_index, provided by the
+     * tracer.
+     */
+    GLuint
+    getElementArrayMaxIndex(GLuint buffer, GLintptr offset, GLsizei count, GLenum type);
+}
+
 static inline GLuint
 _glDrawElementsBaseVertex_count(GLsizei count, GLenum type, const GLvoid *indices, GLint basevertex)
 {
-    GLvoid *temp = 0;
     GLint element_array_buffer = 0;
 
     if (!count) {
         return 0;
     }
 
+    GLuint maxindex;
     _glGetIntegerv(GL_ELEMENT_ARRAY_BUFFER_BINDING, &element_array_buffer);
     if (element_array_buffer) {
         // Read indices from index buffer object
-        GLintptr offset = (GLintptr)indices;
-        GLsizeiptr size = count*_gl_type_size(type);
-        GLvoid *temp = malloc(size);
-        if (!temp) {
-            return 0;
-        }
-        memset(temp, 0, size);
-        _glGetBufferSubData(GL_ELEMENT_ARRAY_BUFFER, offset, size, temp);
-        indices = temp;
+        maxindex = gltrace::getElementArrayMaxIndex(element_array_buffer, (GLintptr)indices, count, type);
     } else {
         if (!indices) {
             return 0;
         }
-    }
-
-    GLuint maxindex = 0;
-    GLsizei i;
-    if (type == GL_UNSIGNED_BYTE) {
-        const GLubyte *p = (const GLubyte *)indices;
-        for (i = 0; i < count; ++i) {
-            if (p[i] > maxindex) {
-                maxindex = p[i];
-            }
-        }
-    } else if (type == GL_UNSIGNED_SHORT) {
-        const GLushort *p = (const GLushort *)indices;
-        for (i = 0; i < count; ++i) {
-            if (p[i] > maxindex) {
-                maxindex = p[i];
-            }
-        }
-    } else if (type == GL_UNSIGNED_INT) {
-        const GLuint *p = (const GLuint *)indices;
-        for (i = 0; i < count; ++i) {
-            if (p[i] > maxindex) {
-                maxindex = p[i];
-            }
-        }
-    } else {
-        os::log("apitrace: warning: %s: unknown GLenum 0x%04X\n", __FUNCTION__, type);
-    }
-
-    if (element_array_buffer) {
-        free(temp);
+        maxindex = _gl_max_index(type, indices, count);
     }
 
     maxindex += basevertex;
@@ -68,6 +68,18 @@ retrace::getSnapshot(void) {
 }
 
 
+bool
+retrace::requestSnapshot(void) {
+    return false;
+}
+
+
+image::Image *
+retrace::getRequestedSnapshot(void) {
+    return NULL;
+}
+
+
 bool
 retrace::dumpState(std::ostream &os)
 {
@@ -81,6 +93,11 @@ retrace::dumpState(std::ostream &os)
 }
 
 
+bool
+retrace::canSkipRendering(void) {
+    return true;
+}
+
 void
 retrace::flushRendering(void) {
 }
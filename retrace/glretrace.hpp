@@ -36,6 +36,8 @@ struct Context {
     Context(glws::Context* context)
         : wsContext(context),
           activeProgram(0),
+          activeQueries(0),
+          transformFeedbackActive(false),
           used(false)
     {
     }
@@ -47,6 +49,12 @@ struct Context {
 
     glws::Context* wsContext;
     GLuint activeProgram;
+
+    // Queries, other than timer queries, and transform feedback, which draws
+    // contribute to
+    unsigned activeQueries;
+    bool transformFeedbackActive;
+
     bool used;
     
     // Context must be current
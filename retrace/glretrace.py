@@ -303,6 +303,35 @@ class GlRetracer(Retracer):
             print r'        glretrace::currentContext->activeProgram = call.arg(0).toUInt();'
             print r'    }'
 
+        # Track the draws whose effects go beyond the render targets, which
+        # must not be skipped when fast-forwarding
+        if function.name in ('glBeginTransformFeedback', 'glBeginTransformFeedbackEXT', 'glBeginTransformFeedbackNV'):
+            print r'    if (glretrace::currentContext) {'
+            print r'        glretrace::currentContext->transformFeedbackActive = true;'
+            print r'    }'
+        if function.name in ('glEndTransformFeedback', 'glEndTransformFeedbackEXT', 'glEndTransformFeedbackNV'):
+            print r'    if (glretrace::currentContext) {'
+            print r'        glretrace::currentContext->transformFeedbackActive = false;'
+            print r'    }'
+        # Timer queries don't depend on what is drawn
+        if function.name in ('glBeginQuery', 'glBeginQueryARB', 'glBeginQueryEXT', 'glBeginQueryIndexed'):
+            print r'    if (glretrace::currentContext && call.arg(0).toUInt() != GL_TIME_ELAPSED) {'
+            print r'        ++glretrace::currentContext->activeQueries;'
+            print r'    }'
+        if function.name in ('glEndQuery', 'glEndQueryARB', 'glEndQueryEXT', 'glEndQueryIndexed'):
+            print r'    if (glretrace::currentContext && call.arg(0).toUInt() != GL_TIME_ELAPSED &&'
+            print r'        glretrace::currentContext->activeQueries) {'
+            print r'        --glretrace::currentContext->activeQueries;'
+            print r'    }'
+        if function.name == 'glBeginOcclusionQueryNV':
+            print r'    if (glretrace::currentContext) {'
+            print r'        ++glretrace::currentContext->activeQueries;'
+            print r'    }'
+        if function.name == 'glEndOcclusionQueryNV':
+            print r'    if (glretrace::currentContext && glretrace::currentContext->activeQueries) {'
+            print r'        --glretrace::currentContext->activeQueries;'
+            print r'    }'
+
         # Only profile if not inside a list as the queries get inserted into list
         if function.name == 'glNewList':
             print r'    glretrace::insideList = true;'
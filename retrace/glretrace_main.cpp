@@ -411,6 +411,22 @@ retrace::getSnapshot(void) {
 }
 
 
+bool
+retrace::requestSnapshot(void) {
+    if (!glretrace::currentDrawable) {
+        return false;
+    }
+
+    return glstate::requestDrawBufferImage();
+}
+
+
+image::Image *
+retrace::getRequestedSnapshot(void) {
+    return glstate::getRequestedDrawBufferImage();
+}
+
+
 bool
 retrace::dumpState(std::ostream &os)
 {
@@ -425,6 +441,22 @@ retrace::dumpState(std::ostream &os)
     return true;
 }
 
+bool
+retrace::canSkipRendering(void) {
+    // Draws being compiled into a display list would be missing from it
+    if (glretrace::insideList) {
+        return false;
+    }
+
+    glretrace::Context *context = glretrace::currentContext;
+    if (context &&
+        (context->activeQueries || context->transformFeedbackActive)) {
+        return false;
+    }
+
+    return true;
+}
+
 void
 retrace::flushRendering(void) {
     glretrace::flushQueries();
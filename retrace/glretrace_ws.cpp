@@ -116,6 +116,7 @@ makeCurrent(trace::Call &call, glws::Drawable *drawable, Context *context)
     }
 
     if (currentDrawable && currentContext) {
+        glstate::flushDrawBufferImages();
         glFlush();
         if (!retrace::doubleBuffer) {
             frame_complete(call);
@@ -61,6 +61,10 @@ Context::Context(void) {
 
     ARB_draw_buffers = !ES;
 
+    // Pixel buffer objects are core since OpenGL 2.1
+    ARB_pixel_buffer_object = !ES && version &&
+        (version[0] > '2' || (version[0] == '2' && version[2] >= '1'));
+
     // TODO: Check extensions we use below
 }
 
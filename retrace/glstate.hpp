@@ -47,6 +47,15 @@ void dumpCurrentContext(std::ostream &os);
 image::Image *
 getDrawBufferImage(void);
 
+bool
+requestDrawBufferImage(void);
+
+image::Image *
+getRequestedDrawBufferImage(void);
+
+void
+flushDrawBufferImages(void);
+
 
 } /* namespace glstate */
 
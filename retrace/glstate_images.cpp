@@ -27,7 +27,9 @@
 #include <string.h>
 
 #include <algorithm>
+#include <deque>
 #include <iostream>
+#include <vector>
 
 #include "image.hpp"
 #include "json.hpp"
@@ -711,16 +713,18 @@ getFramebufferAttachmentDesc(Context &context, GLenum target, GLenum attachment,
 
 
 
-image::Image *
-getDrawBufferImage() {
+/**
+ * Read the draw buffer into a new image, or into the given pixel pack buffer
+ * object, in which case the image pixels are left uninitialized.
+ */
+static image::Image *
+readDrawBufferImage(Context &context, GLuint pbo) {
     GLenum format = GL_RGB;
     GLint channels = _gl_format_channels(format);
     if (channels > 4) {
         return NULL;
     }
 
-    Context context;
-
     GLenum framebuffer_binding;
     GLenum framebuffer_target;
     if (context.ES) {
@@ -791,7 +795,14 @@ getDrawBufferImage() {
     // TODO: reset imaging state too
     context.resetPixelPackState();
 
-    glReadPixels(0, 0, desc.width, desc.height, format, type, image->pixels);
+    if (pbo) {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo);
+        glBufferData(GL_PIXEL_PACK_BUFFER, desc.width * desc.height * channels, NULL, GL_STREAM_READ);
+        glReadPixels(0, 0, desc.width, desc.height, format, type, 0);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    } else {
+        glReadPixels(0, 0, desc.width, desc.height, format, type, image->pixels);
+    }
 
     context.restorePixelPackState();
 
@@ -814,6 +825,135 @@ getDrawBufferImage() {
 }
 
 
+image::Image *
+getDrawBufferImage() {
+    Context context;
+    return readDrawBufferImage(context, 0);
+}
+
+
+/*
+ * Draw buffer images being read back asynchronously, through pixel pack
+ * buffer objects, so that the pipeline needs not to be drained for every
+ * snapshot.  Reading into a buffer object captures the draw buffer contents
+ * at the time of the request, so it is only the retrieval that is deferred.
+ *
+ * Buffer objects belong to the current context, so everything must be
+ * flushed before it changes.
+ *
+ * The buffer names come from glGenBuffers, so they share the name space of
+ * the application's buffers.  Names generated by the trace are mapped, and
+ * will never collide, but names the trace uses without ever generating them
+ * (which compatibility profiles allow) are passed through unchanged, and
+ * might alias a snapshot buffer.  There is no portable way to reserve them,
+ * so such traces should be replayed without -as.
+ */
+struct RequestedImage {
+    // NULL if reading failed
+    image::Image *image;
+
+    // Zero once the pixels have been retrieved
+    GLuint pbo;
+};
+
+static std::deque<RequestedImage> requestedImages;
+static std::vector<GLuint> freeBuffers;
+
+
+static void
+retrieveImage(RequestedImage &requested) {
+    if (!requested.pbo) {
+        return;
+    }
+
+    GLint pack_buffer = 0;
+    glGetIntegerv(GL_PIXEL_PACK_BUFFER_BINDING, &pack_buffer);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, requested.pbo);
+
+    image::Image *image = requested.image;
+    const void *data = glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+    if (data) {
+        memcpy(image->pixels, data, image->width * image->height * image->channels);
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    } else {
+        std::cerr << "warning: failed to map snapshot buffer\n";
+        delete image;
+        requested.image = NULL;
+    }
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, pack_buffer);
+
+    freeBuffers.push_back(requested.pbo);
+    requested.pbo = 0;
+}
+
+
+/**
+ * Start reading back the draw buffer image.  Returns false if not supported,
+ * in which case getDrawBufferImage() should be used instead.
+ */
+bool
+requestDrawBufferImage(void) {
+    Context context;
+    if (!context.ARB_pixel_buffer_object) {
+        return false;
+    }
+
+    GLuint pbo;
+    if (freeBuffers.empty()) {
+        glGenBuffers(1, &pbo);
+    } else {
+        pbo = freeBuffers.back();
+        freeBuffers.pop_back();
+    }
+
+    RequestedImage requested;
+    requested.image = readDrawBufferImage(context, pbo);
+    requested.pbo = requested.image ? pbo : 0;
+    if (!requested.image) {
+        freeBuffers.push_back(pbo);
+    }
+    requestedImages.push_back(requested);
+
+    return true;
+}
+
+
+/**
+ * Get the oldest requested draw buffer image, waiting for it if necessary,
+ * or NULL if reading it failed.
+ */
+image::Image *
+getRequestedDrawBufferImage(void) {
+    if (requestedImages.empty()) {
+        return NULL;
+    }
+
+    RequestedImage requested = requestedImages.front();
+    requestedImages.pop_front();
+    retrieveImage(requested);
+    return requested.image;
+}
+
+
+/**
+ * Retrieve all requested images, and release the buffer objects, while the
+ * context they belong to is still current.
+ */
+void
+flushDrawBufferImages(void) {
+    for (std::deque<RequestedImage>::iterator it = requestedImages.begin();
+         it != requestedImages.end(); ++it) {
+        retrieveImage(*it);
+    }
+
+    if (!freeBuffers.empty()) {
+        glDeleteBuffers(freeBuffers.size(), &freeBuffers[0]);
+        freeBuffers.clear();
+    }
+}
+
+
 /**
  * Dump the image of the currently bound read buffer.
  */
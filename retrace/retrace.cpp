@@ -27,6 +27,7 @@
 #include <string.h>
 #include <iostream>
 
+#include "os_thread.hpp"
 #include "os_time.hpp"
 #include "trace_dump.hpp"
 #include "retrace.hpp"
@@ -35,6 +36,84 @@
 namespace retrace {
 
 
+/* Default chunk size; larger allocations get a chunk of their own */
+static const size_t CHUNK_SIZE = 64 * 1024;
+
+static os::thread_specific_ptr<ScopedAllocator::Arena> arenas;
+
+
+ScopedAllocator::Arena::~Arena() {
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        free(chunks[i].buf);
+    }
+}
+
+
+ScopedAllocator::Arena *
+ScopedAllocator::_getArena(void) {
+    Arena *arena = arenas.get();
+    if (!arena) {
+        arena = new Arena;
+        arenas.reset(arena);
+    }
+    return arena;
+}
+
+
+void *
+ScopedAllocator::_allocChunk(size_t total) {
+    std::vector<Chunk> &chunks = arena->chunks;
+
+    // Move on to the next chunk large enough
+    size_t i = arena->current < chunks.size() ? arena->current + 1 : chunks.size();
+    while (i < chunks.size() && chunks[i].size < total) {
+        ++i;
+    }
+
+    if (i == chunks.size()) {
+        Chunk chunk;
+        chunk.size = std::max(total, CHUNK_SIZE);
+        chunk.buf = static_cast<char *>(malloc(chunk.size));
+        if (!chunk.buf) {
+            return NULL;
+        }
+        chunk.used = 0;
+        chunks.push_back(chunk);
+        if (chunk.size > CHUNK_SIZE) {
+            arena->oversized = true;
+        }
+    }
+
+    arena->current = i;
+    chunks[i].used = total;
+    return chunks[i].buf;
+}
+
+
+/**
+ * Free the chunks allocated for unusually large allocations, once the arena
+ * is empty.
+ */
+void
+ScopedAllocator::_trim(void) {
+    std::vector<Chunk> &chunks = arena->chunks;
+    size_t j = 0;
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        if (chunks[i].size > CHUNK_SIZE) {
+            free(chunks[i].buf);
+        } else {
+            chunks[j++] = chunks[i];
+        }
+    }
+    chunks.resize(j);
+    if (j) {
+        chunks[0].used = 0;
+    }
+    arena->current = 0;
+    arena->oversized = false;
+}
+
+
 static bool call_dumped = false;
 
 
@@ -79,6 +158,12 @@ void Retracer::addCallbacks(const Entry *entries) {
 }
 
 
+bool Retracer::isIgnored(const char *name) const {
+    Map::const_iterator it = map.find(name);
+    return it != map.end() && it->second == &ignore;
+}
+
+
 void Retracer::retrace(trace::Call &call) {
     call_dumped = false;
 
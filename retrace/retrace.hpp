@@ -33,6 +33,7 @@
 #include <list>
 #include <map>
 #include <ostream>
+#include <vector>
 
 #include "trace_model.hpp"
 #include "trace_parser.hpp"
@@ -52,16 +53,54 @@ extern trace::Profiler profiler;
 
 
 /**
- * Similar to alloca(), but implemented with malloc.
+ * Similar to alloca(), but implemented with a per-thread bump arena.
+ *
+ * Allocations are carved out of chunks which are kept around across calls,
+ * and everything allocated through this object is released at once when it
+ * goes out of scope, by rewinding the arena to where it was when this
+ * object was created.
  */
 class ScopedAllocator
 {
+public:
+    struct Chunk {
+        char *buf;
+        size_t size;
+        size_t used;
+    };
+
+    struct Arena {
+        std::vector<Chunk> chunks;
+        size_t current;
+        bool oversized;
+
+        Arena() : current(0), oversized(false) {}
+        ~Arena();
+    };
+
 private:
-    uintptr_t next;
+    /* Header preceding each allocation, which also sets its alignment */
+    static const size_t HEADER_SIZE = 16;
+
+    Arena *arena;
+    size_t markChunk;
+    size_t markUsed;
+
+    static Arena *
+    _getArena(void);
+
+    void *
+    _allocChunk(size_t total);
+
+    void
+    _trim(void);
 
 public:
     ScopedAllocator() :
-        next(0) {
+        arena(_getArena())
+    {
+        markChunk = arena->current;
+        markUsed = markChunk < arena->chunks.size() ? arena->chunks[markChunk].used : 0;
     }
 
     inline void *
@@ -69,16 +108,27 @@ public:
         /* Always return valid address, even when size is zero */
         size = std::max(size, sizeof(uintptr_t));
 
-        uintptr_t * buf = static_cast<uintptr_t *>(malloc(sizeof(uintptr_t) + size));
-        if (!buf) {
+        size_t total = HEADER_SIZE + ((size + HEADER_SIZE - 1) & ~(HEADER_SIZE - 1));
+        if (total < size) {
             return NULL;
         }
 
-        *buf = next;
-        next = reinterpret_cast<uintptr_t>(buf);
-        assert((next & 1) == 0);
+        char *buf;
+        if (arena->current < arena->chunks.size() &&
+            arena->chunks[arena->current].size - arena->chunks[arena->current].used >= total) {
+            Chunk &chunk = arena->chunks[arena->current];
+            buf = chunk.buf + chunk.used;
+            chunk.used += total;
+        } else {
+            buf = static_cast<char *>(_allocChunk(total));
+            if (!buf) {
+                return NULL;
+            }
+        }
 
-        return static_cast<void *>(&buf[1]);
+        *reinterpret_cast<size_t *>(buf) = size;
+
+        return static_cast<void *>(buf + HEADER_SIZE);
     }
 
     template< class T >
@@ -93,42 +143,41 @@ public:
     template< class T >
     inline T *
     alloc(const trace::Value *value) {
-        const trace::Array *array = dynamic_cast<const trace::Array *>(value);
+        const trace::Array *array = value->toArray();
         if (array) {
             return alloc<T>(array->size());
         }
-        const trace::Null *null = dynamic_cast<const trace::Null *>(value);
-        if (null) {
-            return NULL;
-        }
-        assert(0);
+        /* Only NULL is expected here */
+        assert(value->toPointer() == NULL);
         return NULL;
     }
 
     /**
-     * Prevent this pointer from being automatically freed.
+     * Prevent this pointer from being automatically freed, by moving its
+     * contents to the heap.  The memory is never freed.
      */
     template< class T >
     inline void
-    bind(T *ptr) {
+    bind(T *&ptr) {
         if (ptr) {
-            reinterpret_cast<uintptr_t *>(ptr)[-1] |= 1;
+            char *buf = reinterpret_cast<char *>(ptr);
+            size_t size = *reinterpret_cast<size_t *>(buf - HEADER_SIZE);
+            void *heap = malloc(size);
+            if (heap) {
+                memcpy(heap, buf, size);
+                ptr = static_cast<T *>(heap);
+            }
         }
     }
 
     inline
     ~ScopedAllocator() {
-        while (next) {
-            uintptr_t temp = *reinterpret_cast<uintptr_t *>(next);
-
-            bool bind = temp & 1;
-            temp &= ~1;
-
-            if (!bind) {
-                free(reinterpret_cast<void *>(next));
-            }
-
-            next = temp;
+        arena->current = markChunk;
+        if (markChunk < arena->chunks.size()) {
+            arena->chunks[markChunk].used = markUsed;
+        }
+        if (arena->oversized && markChunk == 0 && markUsed == 0) {
+            _trim();
         }
     }
 };
@@ -208,6 +257,11 @@ public:
     void addCallbacks(const Entry *entries);
 
     void retrace(trace::Call &call);
+
+    /**
+     * Whether calls to this function are known to be ignored.
+     */
+    bool isIgnored(const char *name) const;
 };
 
 
@@ -223,9 +277,27 @@ frameComplete(trace::Call &call);
 image::Image *
 getSnapshot(void);
 
+/**
+ * Start taking a snapshot, to be retrieved later, in request order, with
+ * getRequestedSnapshot().  Returns false if not supported, in which case
+ * getSnapshot() must be used instead.
+ */
+bool
+requestSnapshot(void);
+
+image::Image *
+getRequestedSnapshot(void);
+
 bool
 dumpState(std::ostream &os);
 
+/**
+ * Whether drawing calls currently affect nothing but the contents of the
+ * render targets, so that they can be skipped when fast-forwarding.
+ */
+bool
+canSkipRendering(void);
+
 void
 flushRendering(void);
 
@@ -25,9 +25,15 @@
 
 
 #include <string.h>
+
+#include <algorithm>
+#include <deque>
 #include <iostream>
+#include <map>
+#include <vector>
 
 #include "os_binary.hpp"
+#include "os_thread.hpp"
 #include "os_time.hpp"
 #include "image.hpp"
 #include "trace_callset.hpp"
@@ -41,11 +47,24 @@ static bool waitOnFinish = false;
 
 static const char *comparePrefix = NULL;
 static const char *snapshotPrefix = NULL;
+static const char *snapshotFormat = "png";
 static trace::CallSet snapshotFrequency;
 static trace::CallSet compareFrequency;
 
 static unsigned dumpStateCallNo = ~0;
 
+static bool pipeline = true;
+
+static bool fastForward = false;
+
+static bool asyncSnapshots = false;
+
+static bool snapshotDigests = false;
+static const char *digestFilename = NULL;
+
+typedef std::map<unsigned, uint64_t> DigestMap;
+static DigestMap referenceDigests;
+
 
 namespace retrace {
 
@@ -78,49 +97,881 @@ frameComplete(trace::Call &call) {
 }
 
 
+/**
+ * Encodes and writes snapshot images on a pool of worker threads, so that
+ * the replay can go on meanwhile.
+ *
+ * Written images are reported in the order they were taken.  The number of
+ * images in flight is bounded, so the replay waits when the workers fall
+ * behind.
+ */
+class SnapshotWriter
+{
+private:
+    struct Job {
+        image::Image *image;
+        os::String filename;
+        bool done;
+        bool ok;
+    };
+
+    typedef std::deque<Job *> JobList;
+
+    os::recursive_mutex mutex;
+    os::condition_variable cond;
+
+    // Shared state, protected by the mutex
+    JobList pending;
+    JobList jobs;
+    bool stopping;
+
+    std::vector<os::thread *> threads;
+    size_t maxJobs;
+
+    static void
+    runThread(void *arg) {
+        static_cast<SnapshotWriter *>(arg)->run();
+    }
+
+    void
+    run(void) {
+        mutex.lock();
+        while (true) {
+            while (pending.empty() && !stopping) {
+                cond.wait(mutex);
+            }
+            if (pending.empty()) {
+                break;
+            }
+            Job *job = pending.front();
+            pending.pop_front();
+            mutex.unlock();
+
+            bool ok;
+            if (strcmp(snapshotFormat, "qoi") == 0) {
+                ok = job->image->writeQOI(job->filename);
+            } else {
+                ok = job->image->writePNG(job->filename);
+            }
+            delete job->image;
+            job->image = NULL;
+
+            mutex.lock();
+            job->ok = ok;
+            job->done = true;
+            cond.notify_all();
+        }
+        mutex.unlock();
+    }
+
+    // Report the finished jobs, in order.  Must be called with the mutex held.
+    void
+    report(void) {
+        while (!jobs.empty() && jobs.front()->done) {
+            Job *job = jobs.front();
+            jobs.pop_front();
+            if (job->ok && retrace::verbosity >= 0) {
+                std::cout << "Wrote " << job->filename << "\n";
+            }
+            delete job;
+        }
+    }
+
+    void
+    start(void) {
+        unsigned numThreads = os::thread::hardware_concurrency();
+        // Leave a core for the replay
+        numThreads = numThreads > 2 ? numThreads - 1 : 1;
+        maxJobs = 2 * numThreads;
+        stopping = false;
+        for (unsigned i = 0; i < numThreads; ++i) {
+            threads.push_back(new os::thread(runThread, this));
+        }
+    }
+
+public:
+    SnapshotWriter() :
+        stopping(false),
+        maxJobs(0)
+    {}
+
+    ~SnapshotWriter() {
+        stop();
+    }
+
+    /**
+     * Write the image in the snapshot format, taking ownership of the image.
+     */
+    void
+    write(image::Image *image, const char *filename) {
+        if (threads.empty()) {
+            start();
+        }
+
+        Job *job = new Job;
+        job->image = image;
+        job->filename = filename;
+        job->done = false;
+        job->ok = false;
+
+        mutex.lock();
+        report();
+        while (jobs.size() >= maxJobs) {
+            cond.wait(mutex);
+            report();
+        }
+        jobs.push_back(job);
+        pending.push_back(job);
+        cond.notify_all();
+        mutex.unlock();
+    }
+
+    /**
+     * Wait for all images to be written.
+     */
+    void
+    flush(void) {
+        mutex.lock();
+        report();
+        while (!jobs.empty()) {
+            cond.wait(mutex);
+            report();
+        }
+        mutex.unlock();
+    }
+
+    /**
+     * Write all images, and stop the worker threads.
+     */
+    void
+    stop(void) {
+        if (threads.empty()) {
+            return;
+        }
+
+        flush();
+
+        mutex.lock();
+        stopping = true;
+        cond.notify_all();
+        mutex.unlock();
+
+        for (size_t i = 0; i < threads.size(); ++i) {
+            threads[i]->join();
+            delete threads[i];
+        }
+        threads.clear();
+    }
+};
+
+
+static SnapshotWriter snapshotWriter;
+
+
 static void
-takeSnapshot(unsigned call_no) {
-    assert(snapshotPrefix || comparePrefix);
+stopSnapshotWriter(void) {
+    snapshotWriter.stop();
+}
 
-    image::Image *ref = NULL;
 
-    if (comparePrefix) {
-        os::String filename = os::String::format("%s%010u.png", comparePrefix, call_no);
-        ref = image::readPNG(filename);
-        if (!ref) {
+/**
+ * Reads and decodes the reference images ahead of the replay, on a separate
+ * thread.
+ *
+ * Which calls will be compared is only known as they are replayed, so the
+ * reference images to read are found by listing the directory of the
+ * comparison prefix.  Only a few images are kept decoded ahead of time.
+ */
+class ReferencePrefetcher
+{
+private:
+    enum {
+        // Decoded images kept ahead of the replay
+        MAX_CACHED = 8,
+    };
+
+    typedef std::map<unsigned, image::Image *> ImageMap;
+
+    // Call numbers of the reference images, in ascending order
+    std::vector<unsigned> callNos;
+
+    os::recursive_mutex mutex;
+    os::condition_variable cond;
+
+    // Shared state, protected by the mutex
+    size_t next;
+    unsigned position;
+    ImageMap cache;
+    bool decoding;
+    unsigned decodingCallNo;
+    bool stopping;
+
+    os::thread *thread;
+
+    void
+    listReferences(void) {
+        // Split the prefix into directory and file name prefix
+        const char *prefix = comparePrefix;
+        const char *sep = NULL;
+        for (const char *p = prefix; *p; ++p) {
+            if (*p == '/' || *p == OS_DIR_SEP) {
+                sep = p;
+            }
+        }
+
+        os::String dir;
+        const char *namePrefix;
+        if (sep) {
+            dir = os::String::format("%.*s", (int)(sep - prefix + 1), prefix);
+            namePrefix = sep + 1;
+        } else {
+            dir = ".";
+            namePrefix = prefix;
+        }
+        size_t namePrefixLen = strlen(namePrefix);
+
+        std::vector<os::String> names;
+        if (!os::listDirectory(dir, names)) {
             return;
         }
-        if (retrace::verbosity >= 0) {
-            std::cout << "Read " << filename << "\n";
+
+        for (size_t i = 0; i < names.size(); ++i) {
+            const char *name = names[i];
+            if (strncmp(name, namePrefix, namePrefixLen) != 0) {
+                continue;
+            }
+            name += namePrefixLen;
+
+            unsigned call_no = 0;
+            unsigned digits = 0;
+            while (name[digits] >= '0' && name[digits] <= '9') {
+                call_no = call_no * 10 + (name[digits] - '0');
+                ++digits;
+            }
+            if (digits != 10 ||
+                (strcmp(name + digits, ".png") != 0 &&
+                 strcmp(name + digits, ".qoi") != 0)) {
+                continue;
+            }
+
+            if (compareFrequency.contains(call_no)) {
+                callNos.push_back(call_no);
+            }
+        }
+
+        std::sort(callNos.begin(), callNos.end());
+        callNos.erase(std::unique(callNos.begin(), callNos.end()), callNos.end());
+    }
+
+    static void
+    runThread(void *arg) {
+        static_cast<ReferencePrefetcher *>(arg)->run();
+    }
+
+    void
+    run(void) {
+        mutex.lock();
+        while (true) {
+            while (!stopping &&
+                   (next == callNos.size() || cache.size() >= MAX_CACHED)) {
+                cond.wait(mutex);
+            }
+            if (stopping) {
+                break;
+            }
+
+            unsigned call_no = callNos[next++];
+            if (call_no < position) {
+                continue;
+            }
+            decoding = true;
+            decodingCallNo = call_no;
+            mutex.unlock();
+
+            image::Image *image = image::readImage(getFilename(call_no));
+
+            mutex.lock();
+            decoding = false;
+            cache[call_no] = image;
+            cond.notify_all();
+        }
+        mutex.unlock();
+    }
+
+    // Drop the images before the given call.  Must be called with the mutex
+    // held.
+    void
+    evict(unsigned call_no) {
+        while (!cache.empty() && cache.begin()->first < call_no) {
+            delete cache.begin()->second;
+            cache.erase(cache.begin());
+        }
+    }
+
+    // Whether the image for the given call is still to be decoded.  Must be
+    // called with the mutex held.
+    bool
+    isPending(unsigned call_no, size_t index) {
+        return index >= next || (decoding && decodingCallNo == call_no);
+    }
+
+public:
+    ReferencePrefetcher() :
+        next(0),
+        position(0),
+        decoding(false),
+        decodingCallNo(0),
+        stopping(false),
+        thread(NULL)
+    {}
+
+    ~ReferencePrefetcher() {
+        stop();
+    }
+
+    /**
+     * File name of the reference image for the given call, which may be
+     * either a QOI or a PNG image.
+     */
+    static os::String
+    getFilename(unsigned call_no) {
+        os::String filename = os::String::format("%s%010u.qoi", comparePrefix, call_no);
+        if (!filename.exists()) {
+            filename = os::String::format("%s%010u.png", comparePrefix, call_no);
+        }
+        return filename;
+    }
+
+    void
+    start(void) {
+        if (thread) {
+            return;
+        }
+
+        listReferences();
+        if (callNos.empty()) {
+            return;
+        }
+
+        next = 0;
+        position = 0;
+        decoding = false;
+        stopping = false;
+        thread = new os::thread(runThread, this);
+    }
+
+    /**
+     * Get the reference image for the given call, or NULL if there is none.
+     * Calls are expected in ascending order; others are read synchronously.
+     */
+    image::Image *
+    read(unsigned call_no) {
+        std::vector<unsigned>::iterator found =
+            std::lower_bound(callNos.begin(), callNos.end(), call_no);
+        if (!thread ||
+            found == callNos.end() ||
+            *found != call_no) {
+            return image::readImage(getFilename(call_no));
+        }
+        size_t index = found - callNos.begin();
+
+        image::Image *image = NULL;
+        bool hit = false;
+
+        mutex.lock();
+        if (call_no >= position) {
+            position = call_no;
+            evict(call_no);
+            cond.notify_all();
+
+            while (true) {
+                ImageMap::iterator it = cache.find(call_no);
+                if (it != cache.end()) {
+                    image = it->second;
+                    hit = true;
+                    cache.erase(it);
+                    cond.notify_all();
+                    break;
+                }
+                if (!isPending(call_no, index)) {
+                    break;
+                }
+                cond.wait(mutex);
+            }
+        }
+        mutex.unlock();
+
+        if (!hit) {
+            image = image::readImage(getFilename(call_no));
+        }
+
+        return image;
+    }
+
+    void
+    stop(void) {
+        if (!thread) {
+            return;
         }
+
+        mutex.lock();
+        stopping = true;
+        cond.notify_all();
+        mutex.unlock();
+
+        thread->join();
+        delete thread;
+        thread = NULL;
+
+        for (ImageMap::iterator it = cache.begin(); it != cache.end(); ++it) {
+            delete it->second;
+        }
+        cache.clear();
+        callNos.clear();
     }
+};
+
+
+static ReferencePrefetcher referencePrefetcher;
+
+
+static void
+stopReferencePrefetcher(void) {
+    referencePrefetcher.stop();
+}
 
-    image::Image *src = getSnapshot();
+
+/**
+ * Compare and/or write a snapshot, taking ownership of the images.
+ */
+static void
+processSnapshot(unsigned call_no, image::Image *src, image::Image *ref) {
     if (!src) {
+        delete ref;
         return;
     }
 
+    if (ref) {
+        if (retrace::verbosity >= 1) {
+            // Also tell where the snapshot differs the most
+            image::ErrorGrid grid;
+            std::cout << "Snapshot " << call_no << " average precision of " << src->compare(*ref, &grid) << " bits\n";
+            if (grid.columns && grid.rows) {
+                unsigned worstColumn = 0;
+                unsigned worstRow = 0;
+                double worstPrecision = grid.precision(0, 0);
+                for (unsigned row = 0; row < grid.rows; ++row) {
+                    for (unsigned column = 0; column < grid.columns; ++column) {
+                        double precision = grid.precision(column, row);
+                        if (precision < worstPrecision) {
+                            worstColumn = column;
+                            worstRow = row;
+                            worstPrecision = precision;
+                        }
+                    }
+                }
+                std::cout << "Snapshot " << call_no << " worst tile at "
+                          << worstColumn * grid.tileSize << "," << worstRow * grid.tileSize
+                          << " (from top left) precision of " << worstPrecision << " bits\n";
+            }
+        } else {
+            std::cout << "Snapshot " << call_no << " average precision of " << src->compare(*ref) << " bits\n";
+        }
+        delete ref;
+    }
+
+    bool stdoutSnapshots = snapshotPrefix &&
+                           snapshotPrefix[0] == '-' && snapshotPrefix[1] == 0;
+
+    if (snapshotDigests || digestFilename) {
+        uint64_t digest = src->hash();
+
+        // Don't corrupt the images written to stdout
+        std::ostream &out = stdoutSnapshots ? std::cerr : std::cout;
+
+        if (snapshotDigests) {
+            char hex[17];
+            snprintf(hex, sizeof hex, "%016llx", (unsigned long long)digest);
+            out << "Snapshot " << call_no << " digest " << hex << "\n";
+        }
+
+        if (digestFilename) {
+            // Only write the snapshots which differ from the reference
+            DigestMap::const_iterator it = referenceDigests.find(call_no);
+            if (it != referenceDigests.end() && it->second == digest) {
+                delete src;
+                return;
+            }
+            out << "Snapshot " << call_no << " digest "
+                << (it == referenceDigests.end() ? "missing" : "mismatch") << "\n";
+        }
+    }
+
     if (snapshotPrefix) {
-        if (snapshotPrefix[0] == '-' && snapshotPrefix[1] == 0) {
+        if (stdoutSnapshots) {
             char comment[21];
             snprintf(comment, sizeof comment, "%u", call_no);
             src->writePNM(std::cout, comment);
         } else {
-            os::String filename = os::String::format("%s%010u.png", snapshotPrefix, call_no);
-            if (src->writePNG(filename) && retrace::verbosity >= 0) {
-                std::cout << "Wrote " << filename << "\n";
+            os::String filename = os::String::format("%s%010u.%s", snapshotPrefix, call_no, snapshotFormat);
+            // The writer takes ownership of the image
+            snapshotWriter.write(src, filename);
+            return;
+        }
+    }
+
+    delete src;
+}
+
+
+/*
+ * Snapshots being read back asynchronously.
+ */
+struct RequestedSnapshot {
+    unsigned call_no;
+    image::Image *ref;
+};
+
+// Snapshots read back ahead of processing them
+static const size_t MAX_REQUESTED_SNAPSHOTS = 2;
+
+static std::deque<RequestedSnapshot> requestedSnapshots;
+
+
+static void
+retrieveSnapshot(void) {
+    RequestedSnapshot requested = requestedSnapshots.front();
+    requestedSnapshots.pop_front();
+    processSnapshot(requested.call_no, getRequestedSnapshot(), requested.ref);
+}
+
+
+static void
+flushSnapshots(void) {
+    while (!requestedSnapshots.empty()) {
+        retrieveSnapshot();
+    }
+}
+
+
+static void
+takeSnapshot(unsigned call_no) {
+    assert(snapshotPrefix || comparePrefix || snapshotDigests || digestFilename);
+
+    image::Image *ref = NULL;
+
+    if (comparePrefix) {
+        ref = referencePrefetcher.read(call_no);
+        if (!ref) {
+            return;
+        }
+        if (retrace::verbosity >= 0) {
+            std::cout << "Read " << ReferencePrefetcher::getFilename(call_no) << "\n";
+        }
+    }
+
+    if (asyncSnapshots && requestSnapshot()) {
+        RequestedSnapshot requested;
+        requested.call_no = call_no;
+        requested.ref = ref;
+        requestedSnapshots.push_back(requested);
+
+        while (requestedSnapshots.size() > MAX_REQUESTED_SNAPSHOTS) {
+            retrieveSnapshot();
+        }
+        return;
+    }
+
+    // Keep snapshots in order
+    flushSnapshots();
+
+    processSnapshot(call_no, getSnapshot(), ref);
+}
+
+
+/**
+ * Parses calls ahead of the replay on a separate thread, so that trace
+ * decompression, parsing, and the destruction of calls all happen off the
+ * replay critical path.
+ *
+ * Calls are handed over in batches, both ways, so that the mutex is only
+ * taken every few calls.
+ */
+class ParserThread
+{
+private:
+    enum {
+        // Calls parsed before handing them over
+        BATCH_SIZE = 64,
+
+        // Calls parsed ahead of the replay
+        MAX_QUEUED = 1024,
+    };
+
+    typedef std::vector<trace::Call *> CallList;
+
+    os::recursive_mutex mutex;
+    os::condition_variable cond;
+
+    // Shared state, protected by the mutex
+    CallList queued;
+    CallList garbage;
+    bool done;
+    bool stopping;
+    bool waiting;
+
+    // Consumer state
+    CallList calls;
+    size_t next;
+    CallList retired;
+
+    os::thread *thread;
+
+    static void
+    runThread(void *arg) {
+        static_cast<ParserThread *>(arg)->run();
+    }
+
+    static void
+    deleteCalls(CallList &list) {
+        for (CallList::iterator it = list.begin(); it != list.end(); ++it) {
+            delete *it;
+        }
+        list.clear();
+    }
+
+    void
+    run(void) {
+        CallList batch;
+        CallList dead;
+        bool eof = false;
+
+        while (!eof) {
+            trace::Call *call;
+            while (batch.size() < BATCH_SIZE &&
+                   (call = retrace::parser.parse_call())) {
+                batch.push_back(call);
             }
+            eof = batch.size() < BATCH_SIZE;
+
+            mutex.lock();
+            while (queued.size() >= MAX_QUEUED && !stopping) {
+                waiting = true;
+                cond.wait(mutex);
+            }
+            if (stopping) {
+                eof = true;
+            }
+            queued.insert(queued.end(), batch.begin(), batch.end());
+            batch.clear();
+            dead.swap(garbage);
+            done = eof;
+            if (waiting) {
+                waiting = false;
+                cond.notify_all();
+            }
+            mutex.unlock();
+
+            deleteCalls(dead);
         }
     }
 
-    if (ref) {
-        std::cout << "Snapshot " << call_no << " average precision of " << src->compare(*ref) << " bits\n";
-        delete ref;
+public:
+    ParserThread() :
+        done(false),
+        stopping(false),
+        waiting(false),
+        next(0),
+        thread(NULL)
+    {}
+
+    ~ParserThread() {
+        stop();
     }
 
-    delete src;
+    void
+    start(void) {
+        assert(!thread);
+        done = false;
+        stopping = false;
+        thread = new os::thread(runThread, this);
+    }
+
+    /**
+     * Get the next call, or NULL at the end of the trace.
+     */
+    trace::Call *
+    get(void) {
+        if (next == calls.size()) {
+            calls.clear();
+            next = 0;
+
+            mutex.lock();
+            while (queued.empty() && !done) {
+                waiting = true;
+                cond.wait(mutex);
+            }
+            calls.swap(queued);
+            garbage.insert(garbage.end(), retired.begin(), retired.end());
+            if (waiting) {
+                waiting = false;
+                cond.notify_all();
+            }
+            mutex.unlock();
+
+            retired.clear();
+
+            if (calls.empty()) {
+                return NULL;
+            }
+        }
+
+        return calls[next++];
+    }
 
-    return;
+    /**
+     * Hand back a call, to be destroyed by the parser thread.
+     */
+    void
+    release(trace::Call *call) {
+        retired.push_back(call);
+    }
+
+    /**
+     * Stop parsing, and wait for the parser thread to finish.
+     */
+    void
+    stop(void) {
+        if (!thread) {
+            return;
+        }
+
+        // The parser thread may exit on a parse error
+        if (thread->is_current()) {
+            return;
+        }
+
+        mutex.lock();
+        stopping = true;
+        cond.notify_all();
+        mutex.unlock();
+
+        thread->join();
+        delete thread;
+        thread = NULL;
+
+        deleteCalls(queued);
+        deleteCalls(garbage);
+        deleteCalls(retired);
+
+        // Calls before next were handed out, and are owned by the caller
+        // until released
+        calls.erase(calls.begin(), calls.begin() + next);
+        deleteCalls(calls);
+        next = 0;
+    }
+};
+
+
+static ParserThread parserThread;
+
+
+static void
+stopParserThread(void) {
+    parserThread.stop();
+}
+
+
+/**
+ * Read the snapshot digests printed by a previous run with -sd.
+ */
+static bool
+readDigests(const char *filename) {
+    FILE *fp = fopen(filename, "rt");
+    if (!fp) {
+        return false;
+    }
+
+    char line[256];
+    while (fgets(line, sizeof line, fp)) {
+        unsigned call_no;
+        unsigned long long digest;
+        if (sscanf(line, "Snapshot %u digest %llx", &call_no, &digest) == 2) {
+            referenceDigests[call_no] = digest;
+        }
+    }
+
+    fclose(fp);
+    return true;
+}
+
+
+/**
+ * Skip the arguments of the calls which are ignored anyway, unless they
+ * are to be dumped.
+ */
+class IgnoredCallFilter : public trace::CallFilter
+{
+    const retrace::Retracer &retracer;
+
+public:
+    IgnoredCallFilter(const retrace::Retracer &_retracer) :
+        retracer(_retracer)
+    {}
+
+    bool
+    skip(const trace::FunctionSig *sig) const {
+        return retracer.isIgnored(sig->name);
+    }
+};
+
+
+/**
+ * First call whose results are of interest, that is, the first call which
+ * may be snapshotted, or at which the state or pipeline is dumped.
+ */
+static trace::CallNo
+getTargetCallNo(void) {
+    trace::CallNo target = dumpStateCallNo;
+    if (retrace::dumpingPipeline) {
+        target = std::min(target, (trace::CallNo)retrace::dumpPipelineCallNo);
+    }
+    if (!snapshotFrequency.empty()) {
+        target = std::min(target, snapshotFrequency.ranges.front().start);
+    }
+    if (!compareFrequency.empty()) {
+        target = std::min(target, compareFrequency.ranges.front().start);
+    }
+    return target;
+}
+
+
+/**
+ * Whether the call can be skipped when fast-forwarding, which is the case
+ * for calls that only affect the contents of render targets.
+ *
+ * Draws which write to shader storage buffers, images or atomic counters are
+ * not detected, and will be skipped too.
+ */
+static bool
+isFastForwardable(const trace::Call *call) {
+    if (!(call->flags & trace::CALL_FLAG_RENDER)) {
+        return false;
+    }
+
+    if (!canSkipRendering()) {
+        return false;
+    }
+
+    // These are flagged as rendering calls, but also change state
+    const char *name = call->sig->name;
+    if (strcmp(name, "glEnd") == 0 ||
+        strcmp(name, "glCallList") == 0 ||
+        strcmp(name, "glCallLists") == 0) {
+        return false;
+    }
+
+    return true;
 }
 
 
@@ -130,13 +981,38 @@ mainLoop() {
 
     addCallbacks(retracer);
 
+    IgnoredCallFilter filter(retracer);
+    if (retrace::verbosity < 1) {
+        retrace::parser.setCallFilter(&filter);
+    }
+
     long long startTime = 0; 
     frameNo = 0;
 
     startTime = os::getTime();
     trace::Call *call;
 
-    while ((call = retrace::parser.parse_call())) {
+    // Stop parsing before the parser is destroyed, and finish writing
+    // snapshots, should retrace exit early
+    static bool registered = false;
+    if (!registered) {
+        atexit(stopParserThread);
+        atexit(stopSnapshotWriter);
+        atexit(stopReferencePrefetcher);
+        registered = true;
+    }
+
+    if (comparePrefix) {
+        referencePrefetcher.start();
+    }
+
+    if (pipeline) {
+        parserThread.start();
+    }
+
+    trace::CallNo fastForwardCallNo = fastForward ? getTargetCallNo() : 0;
+
+    while ((call = pipeline ? parserThread.get() : retrace::parser.parse_call())) {
         bool swapRenderTarget = call->flags & trace::CALL_FLAG_SWAP_RENDERTARGET;
         bool doSnapshot =
             snapshotFrequency.contains(*call) ||
@@ -158,7 +1034,10 @@ mainLoop() {
         }
 
         callNo = call->no;
-        retracer.retrace(*call);
+        if (call->no >= fastForwardCallNo ||
+            !isFastForwardable(call)) {
+            retracer.retrace(*call);
+        }
 
         if (doSnapshot && !swapRenderTarget) {
             takeSnapshot(call->no);
@@ -167,21 +1046,40 @@ mainLoop() {
         if(dumpingPipeline && 
             call->no >= dumpPipelineCallNo && 
             (call->flags & trace::CALL_FLAG_RENDER)) {
+            flushSnapshots();
             pipelineView(call, std::cout);
             exit(0);
         }
         
-        if (call->no >= dumpStateCallNo &&
-            dumpState(std::cout)) {
-            exit(0);
+        if (call->no >= dumpStateCallNo) {
+            flushSnapshots();
+            if (dumpState(std::cout)) {
+                exit(0);
+            }
+        }
+
+        if (pipeline) {
+            parserThread.release(call);
+        } else {
+            delete call;
         }
+    }
+
+    flushSnapshots();
+
+    referencePrefetcher.stop();
 
-        delete call;
+    if (pipeline) {
+        parserThread.stop();
     }
 
+    retrace::parser.setCallFilter(NULL);
+
     // Reached the end of trace
     flushRendering();
 
+    snapshotWriter.flush();
+
     long long endTime = os::getTime();
     float timeInterval = (endTime - startTime) * (1.0 / os::timeFrequency);
 
@@ -220,10 +1118,16 @@ usage(const char *argv0) {
         "  -sb          use a single buffer visual\n"
         "  -s PREFIX    take snapshots; `-` for PNM stdout output\n"
         "  -S CALLSET   calls to snapshot (default is every frame)\n"
+        "  -sf FORMAT   snapshot image format: png (default), or qoi for much faster encoding\n"
+        "  -as          read snapshots back asynchronously\n"
+        "  -sd          print a digest of each snapshot, instead of writing it\n"
+        "  -cd FILE     compare snapshot digests against FILE, only writing those that differ\n"
         "  -v           increase output verbosity\n"
         "  -D CALLNO    dump state at specific call no\n"
+        "  -ff          fast-forward, skipping draws before the first call to dump or snapshot\n"
         "  -P CALLNO    snapshot pipeline stages at specific call no\n" 
-        "  -w           waitOnFinish on final frame\n";
+        "  -w           waitOnFinish on final frame\n"
+        "  -st          parse the trace on the replay thread\n";
 }
 
 
@@ -297,13 +1201,37 @@ int main(int argc, char **argv)
             }
         } else if (!strcmp(arg, "-S")) {
             snapshotFrequency = trace::CallSet(argv[++i]);
-            if (snapshotPrefix == NULL) {
-                snapshotPrefix = "";
+        } else if (!strcmp(arg, "-sf")) {
+            snapshotFormat = argv[++i];
+            if (strcmp(snapshotFormat, "png") != 0 &&
+                strcmp(snapshotFormat, "qoi") != 0) {
+                std::cerr << "error: unknown snapshot format " << snapshotFormat << "\n";
+                return 1;
             }
+        } else if (!strcmp(arg, "-sd")) {
+            snapshotDigests = true;
+            if (snapshotFrequency.empty()) {
+                snapshotFrequency = trace::CallSet(trace::FREQUENCY_FRAME);
+            }
+        } else if (!strcmp(arg, "-cd")) {
+            digestFilename = argv[++i];
+            if (!readDigests(digestFilename)) {
+                std::cerr << "error: failed to read " << digestFilename << "\n";
+                return 1;
+            }
+            if (snapshotFrequency.empty()) {
+                snapshotFrequency = trace::CallSet(trace::FREQUENCY_FRAME);
+            }
+        } else if (!strcmp(arg, "-as")) {
+            asyncSnapshots = true;
         } else if (!strcmp(arg, "-v")) {
             ++retrace::verbosity;
         } else if (!strcmp(arg, "-w")) {
             waitOnFinish = true;
+        } else if (!strcmp(arg, "-st")) {
+            pipeline = false;
+        } else if (!strcmp(arg, "-ff")) {
+            fastForward = true;
         } else if (arg[1] == 'p') {
             retrace::debug = false;
             retrace::profiling = true;
@@ -323,6 +1251,14 @@ int main(int argc, char **argv)
         }
     }
 
+    // Snapshots are written to the current directory by default, unless
+    // only their digests are wanted
+    if (!snapshotFrequency.empty() &&
+        snapshotPrefix == NULL &&
+        (!snapshotDigests || digestFilename)) {
+        snapshotPrefix = "";
+    }
+
     retrace::setUp();
     if (retrace::profiling) {
         retrace::profiler.setup(retrace::profilingCpuTimes, retrace::profilingGpuTimes, retrace::profilingPixelsDrawn);
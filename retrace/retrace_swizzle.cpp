@@ -44,6 +44,13 @@ struct Region
 typedef std::map<unsigned long long, Region> RegionMap;
 static RegionMap regionMap;
 
+// Reverse map from buffer pointers to region start addresses
+typedef std::map<void *, unsigned long long> BufferMap;
+static BufferMap bufferMap;
+
+// Region hit by the last lookup, as consecutive lookups usually hit the same
+static RegionMap::iterator lastRegion = regionMap.end();
+
 
 static inline bool
 contains(RegionMap::iterator &it, unsigned long long address) {
@@ -53,9 +60,9 @@ contains(RegionMap::iterator &it, unsigned long long address) {
 
 static inline bool
 intersects(RegionMap::iterator &it, unsigned long long start, unsigned long long size) {
-    unsigned long it_start = it->first;
-    unsigned long it_stop  = it->first + it->second.size;
-    unsigned long stop = start + size;
+    unsigned long long it_start = it->first;
+    unsigned long long it_stop  = it->first + it->second.size;
+    unsigned long long stop = start + size;
     return it_start < stop && start < it_stop;
 }
 
@@ -140,11 +147,27 @@ addRegion(unsigned long long address, void *buffer, unsigned long long size)
     region.buffer = buffer;
     region.size = size;
 
-    regionMap[address] = region;
+    RegionMap::iterator it = regionMap.find(address);
+    if (it != regionMap.end()) {
+        BufferMap::iterator bufferIt = bufferMap.find(it->second.buffer);
+        if (bufferIt != bufferMap.end() && bufferIt->second == address) {
+            bufferMap.erase(bufferIt);
+        }
+        it->second = region;
+    } else {
+        regionMap[address] = region;
+    }
+
+    bufferMap[buffer] = address;
 }
 
 static RegionMap::iterator
 lookupRegion(unsigned long long address) {
+    if (lastRegion != regionMap.end() &&
+        contains(lastRegion, address)) {
+        return lastRegion;
+    }
+
     RegionMap::iterator it = regionMap.lower_bound(address);
 
     if (it == regionMap.end() ||
@@ -157,14 +180,29 @@ lookupRegion(unsigned long long address) {
     }
 
     assert(contains(it, address));
+    if (contains(it, address)) {
+        lastRegion = it;
+    }
     return it;
 }
 
+static void
+eraseRegion(RegionMap::iterator it) {
+    if (it == lastRegion) {
+        lastRegion = regionMap.end();
+    }
+    BufferMap::iterator buffer = bufferMap.find(it->second.buffer);
+    if (buffer != bufferMap.end() && buffer->second == it->first) {
+        bufferMap.erase(buffer);
+    }
+    regionMap.erase(it);
+}
+
 void
 delRegion(unsigned long long address) {
     RegionMap::iterator it = lookupRegion(address);
     if (it != regionMap.end()) {
-        regionMap.erase(it);
+        eraseRegion(it);
     } else {
         assert(0);
     }
@@ -173,11 +211,13 @@ delRegion(unsigned long long address) {
 
 void
 delRegionByPointer(void *ptr) {
-    for (RegionMap::iterator it = regionMap.begin(); it != regionMap.end(); ++it) {
-        if (it->second.buffer == ptr) {
-            regionMap.erase(it);
-            return;
-        }
+    BufferMap::iterator it = bufferMap.find(ptr);
+    if (it != bufferMap.end()) {
+        RegionMap::iterator region = regionMap.find(it->second);
+        assert(region != regionMap.end());
+        assert(region->second.buffer == ptr);
+        eraseRegion(region);
+        return;
     }
     assert(0);
 }
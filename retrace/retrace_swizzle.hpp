@@ -28,6 +28,7 @@
 
 
 #include <map>
+#include <vector>
 
 #include "trace_model.hpp"
 
@@ -35,6 +36,34 @@
 namespace retrace {
 
 
+/**
+ * Direct index of a handle value.
+ *
+ * Only handles which are integers (e.g., GL object names) can be directly
+ * indexed; other types (pointers) always fall back to a sparse map.
+ */
+template <class T>
+inline bool
+handleIndex(const T &, size_t &) {
+    return false;
+}
+
+inline bool
+handleIndex(unsigned int key, size_t &index) {
+    index = key;
+    return true;
+}
+
+inline bool
+handleIndex(int key, size_t &index) {
+    if (key < 0) {
+        return false;
+    }
+    index = key;
+    return true;
+}
+
+
 /**
  * Handle map.
  *
@@ -45,6 +74,11 @@ namespace retrace {
  * the implementation to generate an unique name, or pick a value never used
  * before.
  *
+ * Handles are usually small and dense integers, so these are kept in a
+ * vector indexed by the handle, and only the remaining handles are kept in a
+ * std::map.  Unlike std::map, the returned references are only valid until
+ * the next lookup.
+ *
  * XXX: In some cases, instead of returning the key, it would make more sense
  * to return an unused data value (e.g., container count).
  */
@@ -52,22 +86,36 @@ template <class T>
 class map
 {
 private:
+    // Larger handles are not worth a direct index
+    static const size_t MAX_DIRECT = 1024 * 1024;
+
+    std::vector<T> direct;
+    std::vector<bool> valid;
+
     typedef std::map<T, T> base_type;
     base_type base;
 
 public:
 
     T & operator[] (const T &key) {
-        typename base_type::iterator it;
-        it = base.find(key);
-        if (it == base.end()) {
-            return (base[key] = key);
+        size_t index;
+        if (handleIndex(key, index) && index < MAX_DIRECT) {
+            if (index >= direct.size()) {
+                size_t size = direct.size() ? direct.size() : 256;
+                while (size <= index) {
+                    size *= 2;
+                }
+                direct.resize(size);
+                valid.resize(size, false);
+            }
+            if (!valid[index]) {
+                valid[index] = true;
+                direct[index] = key;
+            }
+            return direct[index];
         }
-        return it->second;
-    }
-    
-    const T & operator[] (const T &key) const {
-        typename base_type::const_iterator it;
+
+        typename base_type::iterator it;
         it = base.find(key);
         if (it == base.end()) {
             return (base[key] = key);
@@ -27,7 +27,10 @@
 #define _GLTRACE_HPP_
 
 
+#include <map>
+
 #include "glimports.hpp"
+#include "hash.hpp"
 
 
 namespace gltrace {
@@ -39,6 +42,35 @@ enum Profile {
     PROFILE_ES2,
 };
 
+/*
+ * User array, as last emitted in the trace.
+ */
+struct UserArray {
+    const void *pointer;
+    size_t size;
+    uint64_t hash;
+};
+
+/*
+ * Range of an element array buffer, as used by an indexed draw.
+ */
+struct ElementArrayRange {
+    GLintptr offset;
+    GLsizei count;
+    GLenum type;
+
+    bool
+    operator < (const ElementArrayRange &other) const {
+        if (offset != other.offset) {
+            return offset < other.offset;
+        }
+        if (count != other.count) {
+            return count < other.count;
+        }
+        return type < other.type;
+    }
+};
+
 class Context {
 public:
     enum Profile profile;
@@ -47,6 +79,15 @@ public:
     bool user_arrays_nv;
     unsigned retain_count;
 
+    // Keyed by array slot, as numbered by the generated _trace_user_arrays
+    typedef std::map<unsigned, UserArray> UserArrayMap;
+    UserArrayMap user_array_cache;
+
+    // Maximum index of element array buffer ranges, keyed by buffer name
+    typedef std::map<ElementArrayRange, GLuint> MaxIndexMap;
+    typedef std::map<GLuint, MaxIndexMap> ElementArrayMap;
+    ElementArrayMap element_array_cache;
+
     Context(void) :
         profile(PROFILE_COMPAT),
         user_arrays(false),
@@ -54,6 +95,46 @@ public:
         user_arrays_nv(false),
         retain_count(0)
     { }
+
+    /*
+     * Whether the user array in the given slot must be emitted, that is, if
+     * its pointer, size, parameters, or contents changed since the last time
+     * it was emitted.
+     *
+     * The array is expected to be emitted whenever true is returned.
+     */
+    inline bool
+    updateUserArray(unsigned slot, const void *pointer, size_t size, uint64_t seed) {
+        uint64_t hash = pointer ? hash::hash64(pointer, size, seed) : seed;
+        UserArrayMap::iterator it = user_array_cache.find(slot);
+        if (it != user_array_cache.end()) {
+            UserArray &array = it->second;
+            if (array.pointer == pointer &&
+                array.size == size &&
+                array.hash == hash) {
+                return false;
+            }
+            array.pointer = pointer;
+            array.size = size;
+            array.hash = hash;
+        } else {
+            UserArray array;
+            array.pointer = pointer;
+            array.size = size;
+            array.hash = hash;
+            user_array_cache[slot] = array;
+        }
+        return true;
+    }
+
+    /*
+     * Forget all emitted user arrays, e.g., when the vertex array state is
+     * changed by a call which is traced verbatim.
+     */
+    inline void
+    invalidateUserArrays(void) {
+        user_array_cache.clear();
+    }
 };
 
 void
@@ -74,6 +155,24 @@ clearContext(void);
 gltrace::Context *
 getContext(void);
 
+GLuint
+getElementArrayMaxIndex(GLuint buffer, GLintptr offset, GLsizei count, GLenum type);
+
+GLuint
+getBufferBinding(GLenum target);
+
+void
+invalidateBuffer(GLuint buffer);
+
+void
+invalidateBufferTarget(GLenum target);
+
+void
+setBufferGPUWritable(GLuint buffer);
+
+void
+setBufferTargetGPUWritable(GLenum target, GLuint buffer);
+
 const GLubyte *
 _glGetString_override(GLenum name);
 
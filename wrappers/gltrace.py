@@ -381,6 +381,87 @@ class GlTracer(Tracer):
         #"glMatrixIndexPointerARB",
     ))
 
+    # Functions, other than the array pointer ones, which change the vertex
+    # array state in ways that invalidate previously emitted user arrays.
+    vertex_array_state_function_names = set((
+        'glPopClientAttrib',
+        'glClientAttribDefaultEXT',
+        'glBindVertexArray',
+        'glBindVertexArrayAPPLE',
+        'glBindVertexArrayOES',
+        # Deleting the bound vertex array object reverts to the default one
+        'glDeleteVertexArrays',
+        'glDeleteVertexArraysAPPLE',
+        'glDeleteVertexArraysOES',
+        'glBindVertexBuffer',
+        'glVertexAttribFormat',
+        'glVertexAttribIFormat',
+        'glVertexAttribLFormat',
+        'glVertexAttribBinding',
+    ))
+
+    # Functions which write buffer contents, and the argument naming the
+    # buffer target
+    buffer_target_write_function_names = {
+        'glBufferData': 'target',
+        'glBufferDataARB': 'target',
+        'glBufferSubData': 'target',
+        'glBufferSubDataARB': 'target',
+        'glMapBuffer': 'target',
+        'glMapBufferARB': 'target',
+        'glMapBufferOES': 'target',
+        'glMapBufferRange': 'target',
+        'glUnmapBuffer': 'target',
+        'glUnmapBufferARB': 'target',
+        'glUnmapBufferOES': 'target',
+        'glFlushMappedBufferRange': 'target',
+        'glFlushMappedBufferRangeAPPLE': 'target',
+        'glClearBufferData': 'target',
+        'glClearBufferSubData': 'target',
+        'glCopyBufferSubData': 'writeTarget',
+    }
+
+    # Functions which write buffer contents, and the argument naming the
+    # buffer object
+    buffer_write_function_names = {
+        'glNamedBufferDataEXT': 'buffer',
+        'glNamedBufferSubDataEXT': 'buffer',
+        'glMapNamedBufferEXT': 'buffer',
+        'glMapNamedBufferRangeEXT': 'buffer',
+        'glUnmapNamedBufferEXT': 'buffer',
+        'glFlushMappedNamedBufferRangeEXT': 'buffer',
+        'glClearNamedBufferDataEXT': 'buffer',
+        'glClearNamedBufferSubDataEXT': 'buffer',
+        'glNamedCopyBufferSubDataEXT': 'writeBuffer',
+        'glInvalidateBufferData': 'buffer',
+        'glInvalidateBufferSubData': 'buffer',
+    }
+
+    # Functions which bind buffers to targets, some of which allow the GPU to
+    # write the buffer contents
+    buffer_bind_function_names = set((
+        'glBindBuffer',
+        'glBindBufferARB',
+        'glBindBufferBase',
+        'glBindBufferBaseEXT',
+        'glBindBufferBaseNV',
+        'glBindBufferRange',
+        'glBindBufferRangeEXT',
+        'glBindBufferRangeNV',
+        'glBindBufferOffsetEXT',
+        'glBindBufferOffsetNV',
+    ))
+
+    # Functions which bind buffers to textures, which may be written by the
+    # GPU via image stores
+    texture_buffer_function_names = set((
+        'glTexBuffer',
+        'glTexBufferARB',
+        'glTexBufferEXT',
+        'glTextureBufferEXT',
+        'glMultiTexBufferEXT',
+    ))
+
     draw_function_names = set((
         'glDrawArrays',
         'glDrawElements',
@@ -411,6 +492,16 @@ class GlTracer(Tracer):
         'glDrawElementsInstancedEXT',
     ))
 
+    # Functions which terminate a frame
+    frame_terminator_function_names = set((
+        'glXSwapBuffers',
+        'wglSwapBuffers',
+        'wglSwapLayerBuffers',
+        'eglSwapBuffers',
+        'CGLFlushDrawable',
+        'glFrameTerminatorGREMEDY',
+    ))
+
     interleaved_formats = [
          'GL_V2F',
          'GL_V3F',
@@ -486,9 +577,35 @@ class GlTracer(Tracer):
             print '        return;'
             print '    }'
 
-        # ... to the draw calls
+        # The retracer's vertex array state is about to change behind the
+        # user array cache's back, so forget which arrays have been emitted
+        if function.name in self.array_pointer_function_names or \
+           function.name in self.vertex_array_state_function_names:
+            print '    gltrace::getContext()->invalidateUserArrays();'
+
+        # Keep the element array buffer max index cache coherent
+        if function.name in self.buffer_target_write_function_names:
+            target = self.buffer_target_write_function_names[function.name]
+            print '    gltrace::invalidateBufferTarget(%s);' % target
+        if function.name in self.buffer_write_function_names:
+            buffer = self.buffer_write_function_names[function.name]
+            print '    gltrace::invalidateBuffer(%s);' % buffer
+        if function.name in ('glDeleteBuffers', 'glDeleteBuffersARB'):
+            buffers = function.args[1].name
+            print '    if (%s) {' % buffers
+            print '        for (GLsizei _i = 0; _i < n; ++_i) {'
+            print '            gltrace::invalidateBuffer(%s[_i]);' % buffers
+            print '        }'
+            print '    }'
+        if function.name in self.buffer_bind_function_names:
+            print '    gltrace::setBufferTargetGPUWritable(target, buffer);'
+        if function.name in self.texture_buffer_function_names:
+            print '    gltrace::setBufferGPUWritable(buffer);'
+
+        # ... to the draw calls (timeline traces don't need them, as their
+        # contents would be elided anyway)
         if function.name in self.draw_function_names:
-            print '    if (_need_user_arrays()) {'
+            print '    if (!trace::localWriter.isTimeline() && _need_user_arrays()) {'
             arg_names = ', '.join([arg.name for arg in function.args[1:]])
             print '        GLuint _count = _%s_count(%s);' % (function.name, arg_names)
             print '        _trace_user_arrays(_count);'
@@ -634,6 +751,9 @@ class GlTracer(Tracer):
 
         Tracer.traceFunctionImplBody(self, function)
 
+        if function.name in self.frame_terminator_function_names:
+            print '    trace::localWriter.endFrame();'
+
     marker_functions = [
         # GL_GREMEDY_string_marker
         'glStringMarkerGREMEDY',
@@ -810,6 +930,15 @@ class GlTracer(Tracer):
             print '    }'
             return
 
+        # Delta encode buffer sub-uploads against the previous upload to the
+        # same buffer range
+        if function.name in ('glBufferSubData', 'glBufferSubDataARB') and arg.name == 'data':
+            print '    trace::localWriter.writeBlobDelta(gltrace::getBufferBinding(target), offset, data, size);'
+            return
+        if function.name == 'glNamedBufferSubDataEXT' and arg.name == 'data':
+            print '    trace::localWriter.writeBlobDelta(buffer, offset, data, size);'
+            return
+
         # Several GL state functions take GLenum symbolic names as
         # integer/floats; so dump the symbolic name whenever possible
         if function.name.startswith('gl') \
@@ -836,7 +965,7 @@ class GlTracer(Tracer):
         print '{'
         print '    gltrace::Context *ctx = gltrace::getContext();'
 
-        for camelcase_name, uppercase_name in self.arrays:
+        for slot, (camelcase_name, uppercase_name) in enumerate(self.arrays):
             # in which profile is the array available?
             profile_check = 'ctx->profile == gltrace::PROFILE_COMPAT'
             if camelcase_name in self.arrays_es1:
@@ -846,6 +975,10 @@ class GlTracer(Tracer):
             enable_name = 'GL_%s_ARRAY' % uppercase_name
             binding_name = 'GL_%s_ARRAY_BUFFER_BINDING' % uppercase_name
             function = api.getFunctionByName(function_name)
+            if uppercase_name == 'TEXTURE_COORD':
+                slot_expr = '(%uU << 16) | unit' % slot
+            else:
+                slot_expr = '%uU << 16' % slot
 
             print '    // %s' % function.prototype()
             print '  if (%s) {' % profile_check
@@ -866,6 +999,11 @@ class GlTracer(Tracer):
             arg_names = ', '.join([arg.name for arg in function.args[:-1]])
             print '            size_t _size = _%s_size(%s, count);' % (function.name, arg_names)
 
+            # Skip arrays which were already emitted and did not change since
+            print '            const GLint _params[] = {%s};' % arg_names
+            print '            uint64_t _seed = hash::hash64(_params, sizeof _params);'
+            print '            if (ctx->updateUserArray(%s, pointer, _size, _seed)) {' % slot_expr
+
             # Emit a fake function
             self.array_trace_intermezzo(api, uppercase_name)
             print '            unsigned _call = trace::localWriter.beginEnter(&_%s_sig);' % (function.name,)
@@ -881,6 +1019,7 @@ class GlTracer(Tracer):
             print '            trace::localWriter.endEnter();'
             print '            trace::localWriter.beginLeave(_call);'
             print '            trace::localWriter.endLeave();'
+            print '            }'
             print '        }'
             print '    }'
             self.array_epilog(api, uppercase_name)
@@ -904,13 +1043,14 @@ class GlTracer(Tracer):
         print
         print '    vertex_attrib _vertex_attrib = _get_vertex_attrib();'
         print
-        for suffix in ['', 'ARB', 'NV']:
+        for variant, suffix in enumerate(['', 'ARB', 'NV']):
             if suffix:
                 SUFFIX = '_' + suffix
             else:
                 SUFFIX = suffix
             function_name = 'glVertexAttribPointer' + suffix
             function = api.getFunctionByName(function_name)
+            slot = len(self.arrays) + variant
 
             print '    // %s' % function.prototype()
             print '    if (_vertex_attrib == VERTEX_ATTRIB%s) {' % SUFFIX
@@ -945,6 +1085,11 @@ class GlTracer(Tracer):
             arg_names = ', '.join([arg.name for arg in function.args[1:-1]])
             print '                    size_t _size = _%s_size(%s, count);' % (function.name, arg_names)
 
+            # Skip arrays which were already emitted and did not change since
+            print '                    const GLint _params[] = {%s};' % arg_names
+            print '                    uint64_t _seed = hash::hash64(_params, sizeof _params);'
+            print '                    if (ctx->updateUserArray((%uU << 16) | index, pointer, _size, _seed)) {' % slot
+
             # Emit a fake function
             print '                    unsigned _call = trace::localWriter.beginEnter(&_%s_sig);' % (function.name,)
             for arg in function.args:
@@ -959,6 +1104,7 @@ class GlTracer(Tracer):
             print '                    trace::localWriter.endEnter();'
             print '                    trace::localWriter.beginLeave(_call);'
             print '                    trace::localWriter.endLeave();'
+            print '                    }'
             print '                }'
             print '            }'
             print '        }'
@@ -30,11 +30,16 @@
 #include <map>
 #if defined(_MSC_VER)
 #include <memory>
+#include <intrin.h>
 #else
 #include <tr1/memory>
 #endif
 
+#include <set>
+
+#include <glproc.hpp>
 #include <gltrace.hpp>
+#include <glsize.hpp>
 #include <os_thread.hpp>
 
 namespace gltrace {
@@ -43,6 +48,31 @@ typedef std::tr1::shared_ptr<Context> context_ptr_t;
 static std::map<uintptr_t, context_ptr_t> context_map;
 static os::recursive_mutex context_map_mutex;
 
+/*
+ * Incremented whenever contexts are added or removed from context_map, so
+ * that setContext can tell whether a thread's previous lookup is still valid
+ * without locking.  Only accessed atomically.
+ */
+static volatile long context_map_generation = 0;
+
+static inline long _getGeneration(void)
+{
+#if defined(_MSC_VER)
+    return _InterlockedCompareExchange(&context_map_generation, 0, 0);
+#else
+    return __sync_add_and_fetch(&context_map_generation, 0);
+#endif
+}
+
+static inline void _bumpGeneration(void)
+{
+#if defined(_MSC_VER)
+    _InterlockedIncrement(&context_map_generation);
+#else
+    __sync_add_and_fetch(&context_map_generation, 1);
+#endif
+}
+
 class ThreadState {
 public:
     context_ptr_t current_context;
@@ -51,7 +81,15 @@ public:
                                       * context, but the app still calls some
                                       * GL function that expects one.
                                       */
-    ThreadState() : dummy_context(new Context)
+
+    // Last context looked up by setContext
+    uintptr_t current_context_id;
+    long current_context_generation;
+
+    ThreadState() :
+        dummy_context(new Context),
+        current_context_id(0),
+        current_context_generation(-1)
     {
         current_context = dummy_context;
     }
@@ -59,6 +97,14 @@ public:
 
 static os::thread_specific_ptr<struct ThreadState> thread_state;
 
+#ifdef OS_THREAD_SPECIFIC
+/*
+ * Raw pointer to the current context, for getContext, which is called by
+ * many wrappers.  Ownership is kept by ThreadState::current_context.
+ */
+static OS_THREAD_SPECIFIC(Context *) current_context_ptr = NULL;
+#endif
+
 static ThreadState *get_ts(void)
 {
     ThreadState *ts = thread_state.get();
@@ -71,7 +117,15 @@ static ThreadState *get_ts(void)
     return ts;
 }
 
-static void _retainContext(context_ptr_t ctx)
+static void _setCurrentContext(ThreadState *ts, const context_ptr_t &ctx)
+{
+    ts->current_context = ctx;
+#ifdef OS_THREAD_SPECIFIC
+    current_context_ptr = ctx.get();
+#endif
+}
+
+static void _retainContext(Context *ctx)
 {
     ctx->retain_count++;
 }
@@ -79,12 +133,13 @@ static void _retainContext(context_ptr_t ctx)
 void retainContext(uintptr_t context_id)
 {
     context_map_mutex.lock();
-    if (context_map.find(context_id) != context_map.end())
-        _retainContext(context_map[context_id]);
+    std::map<uintptr_t, context_ptr_t>::iterator it = context_map.find(context_id);
+    if (it != context_map.end())
+        _retainContext(it->second.get());
     context_map_mutex.unlock();
 }
 
-static bool _releaseContext(context_ptr_t ctx)
+static bool _releaseContext(Context *ctx)
 {
     return !(--ctx->retain_count);
 }
@@ -96,17 +151,20 @@ static bool _releaseContext(context_ptr_t ctx)
  */
 bool releaseContext(uintptr_t context_id)
 {
-    bool res;
+    bool res = false;
 
     context_map_mutex.lock();
     /*
      * This can potentially called (from glX) with an invalid context_id,
      * so don't assert on it being valid.
      */
-    if (context_map.find(context_id) != context_map.end()) {
-        res = _releaseContext(context_map[context_id]);
-        if (res)
-            context_map.erase(context_id);
+    std::map<uintptr_t, context_ptr_t>::iterator it = context_map.find(context_id);
+    if (it != context_map.end()) {
+        res = _releaseContext(it->second.get());
+        if (res) {
+            context_map.erase(it);
+            _bumpGeneration();
+        }
     }
     context_map_mutex.unlock();
 
@@ -115,47 +173,256 @@ bool releaseContext(uintptr_t context_id)
 
 void createContext(uintptr_t context_id)
 {
+    context_map_mutex.lock();
+
     // wglCreateContextAttribsARB causes internal calls to wglCreateContext to be
     // traced, causing context to be defined twice.
-    if (context_map.find(context_id) != context_map.end()) {
-        return;
+    if (context_map.find(context_id) == context_map.end()) {
+        context_ptr_t ctx(new Context);
+        _retainContext(ctx.get());
+        context_map[context_id] = ctx;
+        _bumpGeneration();
     }
 
-    context_ptr_t ctx(new Context);
-
-    context_map_mutex.lock();
-
-    _retainContext(ctx);
-    context_map[context_id] = ctx;
-
     context_map_mutex.unlock();
 }
 
 void setContext(uintptr_t context_id)
 {
     ThreadState *ts = get_ts();
-    context_ptr_t ctx;
+
+    // Applications often make the same context current over and over again
+    if (ts->current_context_id == context_id &&
+        ts->current_context_generation == _getGeneration() &&
+        ts->current_context != ts->dummy_context) {
+        return;
+    }
 
     context_map_mutex.lock();
 
-    assert(context_map.find(context_id) != context_map.end());
-    ctx = context_map[context_id];
+    std::map<uintptr_t, context_ptr_t>::iterator it = context_map.find(context_id);
+    assert(it != context_map.end());
+    _setCurrentContext(ts, it->second);
+    ts->current_context_id = context_id;
+    ts->current_context_generation = _getGeneration();
 
     context_map_mutex.unlock();
-
-    ts->current_context = ctx;
 }
 
 void clearContext(void)
 {
     ThreadState *ts = get_ts();
 
-    ts->current_context = ts->dummy_context;
+    _setCurrentContext(ts, ts->dummy_context);
 }
 
 Context *getContext(void)
 {
+#ifdef OS_THREAD_SPECIFIC
+    Context *ctx = current_context_ptr;
+    if (ctx) {
+        return ctx;
+    }
+
+    ThreadState *ts = get_ts();
+    ctx = ts->current_context.get();
+    current_context_ptr = ctx;
+    return ctx;
+#else
     return get_ts()->current_context.get();
+#endif
+}
+
+
+/*
+ * Element array buffer max index cache.
+ *
+ * Buffer names may be shared among contexts, so invalidations are broadcast
+ * to every context.  Buffers that may be written by the GPU (transform
+ * feedback, shader storage, etc.) are never cached.  All of this is
+ * protected by context_map_mutex.
+ */
+
+// Upper bound of cached ranges per buffer
+#define MAX_ELEMENT_ARRAY_RANGES 1024
+
+// Whether anything was ever cached, so that buffer writes are cheap otherwise.
+// Protected by context_map_mutex.
+static bool element_array_cache_used = false;
+
+// Names of buffers which were ever bound for GPU writes
+static std::set<GLuint> gpu_writable_buffers;
+
+GLuint getElementArrayMaxIndex(GLuint buffer, GLintptr offset, GLsizei count, GLenum type)
+{
+    ThreadState *ts = get_ts();
+    Context *ctx = getContext();
+
+    // Dummy contexts don't receive invalidations
+    if (ctx == ts->dummy_context.get()) {
+        return _glElementArrayBuffer_max_index(offset, count, type);
+    }
+
+    ElementArrayRange range;
+    range.offset = offset;
+    range.count = count;
+    range.type = type;
+
+    context_map_mutex.lock();
+
+    if (gpu_writable_buffers.find(buffer) != gpu_writable_buffers.end()) {
+        context_map_mutex.unlock();
+        return _glElementArrayBuffer_max_index(offset, count, type);
+    }
+
+    Context::MaxIndexMap &ranges = ctx->element_array_cache[buffer];
+    Context::MaxIndexMap::const_iterator it = ranges.find(range);
+    if (it != ranges.end()) {
+        GLuint maxindex = it->second;
+        context_map_mutex.unlock();
+        return maxindex;
+    }
+
+    GLuint maxindex = _glElementArrayBuffer_max_index(offset, count, type);
+
+    if (ranges.size() >= MAX_ELEMENT_ARRAY_RANGES) {
+        ranges.clear();
+    }
+    ranges[range] = maxindex;
+    element_array_cache_used = true;
+
+    context_map_mutex.unlock();
+
+    return maxindex;
+}
+
+static void _invalidateBuffer(GLuint buffer)
+{
+    std::map<uintptr_t, context_ptr_t>::iterator it;
+    for (it = context_map.begin(); it != context_map.end(); ++it) {
+        it->second->element_array_cache.erase(buffer);
+    }
+}
+
+static void _invalidateAllBuffers(void)
+{
+    std::map<uintptr_t, context_ptr_t>::iterator it;
+    for (it = context_map.begin(); it != context_map.end(); ++it) {
+        it->second->element_array_cache.clear();
+    }
+}
+
+/*
+ * Called whenever the contents of a buffer are (or may be) changed.
+ */
+void invalidateBuffer(GLuint buffer)
+{
+    context_map_mutex.lock();
+    if (element_array_cache_used) {
+        _invalidateBuffer(buffer);
+    }
+    context_map_mutex.unlock();
+}
+
+static GLenum _getBufferBinding(GLenum target)
+{
+    switch (target) {
+    case GL_ARRAY_BUFFER:
+        return GL_ARRAY_BUFFER_BINDING;
+    case GL_ELEMENT_ARRAY_BUFFER:
+        return GL_ELEMENT_ARRAY_BUFFER_BINDING;
+    case GL_PIXEL_PACK_BUFFER:
+        return GL_PIXEL_PACK_BUFFER_BINDING;
+    case GL_PIXEL_UNPACK_BUFFER:
+        return GL_PIXEL_UNPACK_BUFFER_BINDING;
+    case GL_TRANSFORM_FEEDBACK_BUFFER:
+        return GL_TRANSFORM_FEEDBACK_BUFFER_BINDING;
+    case GL_UNIFORM_BUFFER:
+        return GL_UNIFORM_BUFFER_BINDING;
+    case GL_COPY_READ_BUFFER:
+        return GL_COPY_READ_BUFFER_BINDING;
+    case GL_COPY_WRITE_BUFFER:
+        return GL_COPY_WRITE_BUFFER_BINDING;
+    case GL_DRAW_INDIRECT_BUFFER:
+        return GL_DRAW_INDIRECT_BUFFER_BINDING;
+    case GL_ATOMIC_COUNTER_BUFFER:
+        return GL_ATOMIC_COUNTER_BUFFER_BINDING;
+    case GL_DISPATCH_INDIRECT_BUFFER:
+        return GL_DISPATCH_INDIRECT_BUFFER_BINDING;
+    case GL_SHADER_STORAGE_BUFFER:
+        return GL_SHADER_STORAGE_BUFFER_BINDING;
+    default:
+        return GL_NONE;
+    }
+}
+
+GLuint getBufferBinding(GLenum target)
+{
+    GLenum binding = _getBufferBinding(target);
+    GLint buffer = 0;
+    if (binding != GL_NONE) {
+        _glGetIntegerv(binding, &buffer);
+    }
+    return buffer;
+}
+
+/*
+ * Same as invalidateBuffer, but for the buffer bound to the given target.
+ */
+void invalidateBufferTarget(GLenum target)
+{
+    // Avoid querying the binding when nothing was cached
+    context_map_mutex.lock();
+    bool used = element_array_cache_used;
+    context_map_mutex.unlock();
+    if (!used) {
+        return;
+    }
+
+    GLenum binding = _getBufferBinding(target);
+    GLint buffer = 0;
+    if (binding != GL_NONE) {
+        _glGetIntegerv(binding, &buffer);
+    }
+
+    context_map_mutex.lock();
+    if (binding != GL_NONE) {
+        _invalidateBuffer(buffer);
+    } else {
+        _invalidateAllBuffers();
+    }
+    context_map_mutex.unlock();
+}
+
+/*
+ * Called whenever a buffer may be subsequently written by the GPU, behind our
+ * back.
+ */
+void setBufferGPUWritable(GLuint buffer)
+{
+    if (!buffer) {
+        return;
+    }
+
+    context_map_mutex.lock();
+    gpu_writable_buffers.insert(buffer);
+    _invalidateBuffer(buffer);
+    context_map_mutex.unlock();
+}
+
+void setBufferTargetGPUWritable(GLenum target, GLuint buffer)
+{
+    switch (target) {
+    case GL_PIXEL_PACK_BUFFER:
+    case GL_TRANSFORM_FEEDBACK_BUFFER:
+    case GL_ATOMIC_COUNTER_BUFFER:
+    case GL_SHADER_STORAGE_BUFFER:
+    case GL_TEXTURE_BUFFER:
+        setBufferGPUWritable(buffer);
+        break;
+    default:
+        break;
+    }
 }
 
 }
@@ -188,13 +188,17 @@ class ValueSerializer(stdapi.Visitor):
         index = '_i' + array.type.tag
         print '    if (%s) {' % instance
         print '        size_t %s = %s > 0 ? %s : 0;' % (length, array.length, array.length)
-        print '        trace::localWriter.beginArray(%s);' % length
-        print '        for (size_t %s = 0; %s < %s; ++%s) {' % (index, index, length, index)
-        print '            trace::localWriter.beginElement();'
+        print '        if (trace::localWriter.isTimeline()) {'
+        print '            trace::localWriter.writeElided(%s);' % length
+        print '        } else {'
+        print '            trace::localWriter.beginArray(%s);' % length
+        print '            for (size_t %s = 0; %s < %s; ++%s) {' % (index, index, length, index)
+        print '                trace::localWriter.beginElement();'
         self.visit(array.type, '(%s)[%s]' % (instance, index))
-        print '            trace::localWriter.endElement();'
+        print '                trace::localWriter.endElement();'
+        print '            }'
+        print '            trace::localWriter.endArray();'
         print '        }'
-        print '        trace::localWriter.endArray();'
         print '    } else {'
         print '        trace::localWriter.writeNull();'
         print '    }'
@@ -687,7 +691,7 @@ class Tracer:
         print '        trace::localWriter.writePointer((uintptr_t)%s);' % dest
         print '        trace::localWriter.endArg();'
         print '        trace::localWriter.beginArg(1);'
-        print '        trace::localWriter.writeBlob(%s, %s);' % (src, length)
+        print '        trace::localWriter.writeBlobDelta((uintptr_t)(%s), 0, %s, %s);' % (dest, src, length)
         print '        trace::localWriter.endArg();'
         print '        trace::localWriter.beginArg(2);'
         print '        trace::localWriter.writeUInt(%s);' % length